@@ -0,0 +1,279 @@
+#ifndef ASSEMBLER_C
+#define ASSEMBLER_C
+
+#include "lexer.c"
+#include "cpu.c"
+
+// Two-pass assembler over the lexer's token stream. parse_program() turns
+// the tokens into a Program of labels and instructions, assemble_program()
+// lays it out from an origin, resolves labels and encodes it.
+//
+// Hex operands with more than two digits are kept absolute even when the
+// value would fit in zero page; labels are always absolute. Only documented
+// instructions are accepted, there are no directives yet.
+
+static const char *op_names[] = {
+  "ADC","AND","ASL","BCC","BCS","BEQ","BIT","BMI","BNE","BPL","BRK","BVC",
+  "BVS","CLC","CLD","CLI","CLV","CMP","CPX","CPY","DEC","DEX","DEY","EOR",
+  "INC","INX","INY","JMP","JSR","LDA","LDX","LDY","LSR","NOP","ORA","PHA",
+  "PHP","PLA","PLP","ROL","ROR","RTI","RTS","SBC","SEC","SED","SEI","STA",
+  "STX","STY","TAX","TAY","TSX","TXA","TXS","TYA", NULL
+};
+
+#define OP_COUNT   (OP_TYA + 1)
+#define MODE_COUNT (MODE_REL + 1)
+
+static const uint8_t mode_sizes[MODE_COUNT] = {
+  [MODE_IMP] = 1, [MODE_ACC] = 1, [MODE_IMM] = 2, [MODE_ZP]  = 2,
+  [MODE_ZPX] = 2, [MODE_ZPY] = 2, [MODE_ABS] = 3, [MODE_ABX] = 3,
+  [MODE_ABY] = 3, [MODE_IND] = 3, [MODE_IZX] = 2, [MODE_IZY] = 2,
+  [MODE_REL] = 2,
+};
+
+// opcode for each op and mode, -1 where the combination doesn't exist
+static int16_t encode_table[OP_COUNT][MODE_COUNT];
+static int encode_table_ready = 0;
+
+static void init_encode_table(void) {
+  if (encode_table_ready) return;
+  for (int op = 0; op < OP_COUNT; op++)
+    for (int mode = 0; mode < MODE_COUNT; mode++)
+      encode_table[op][mode] = -1;
+  for (int opcode = 0; opcode < 0x100; opcode++)
+    if (opcode_table[opcode].cycles)
+      encode_table[opcode_table[opcode].op][opcode_table[opcode].mode] = opcode;
+  encode_table_ready = 1;
+}
+
+// ITEM_REMOVED marks instructions the optimizer dropped; they keep their
+// place so items can still be matched up with the source.
+typedef enum { ITEM_LABEL, ITEM_INSTR, ITEM_REMOVED } item_kind;
+
+typedef struct {
+  uint8_t kind;    // item_kind
+  uint8_t op;      // op_t
+  uint8_t mode;    // addr_mode
+  uint16_t value;  // operand, once symbol is resolved
+  char *symbol;    // label name for ITEM_LABEL, operand label otherwise
+  uint16_t addr;   // set by assemble_program
+  unsigned int line;
+} Instr;
+
+typedef struct {
+  Instr *items;
+  size_t capacity;
+  size_t size;
+} Program;
+
+static char asm_error[128];
+
+void program_init(Program *prog, size_t capacity) {
+  prog->capacity = capacity;
+  prog->size = 0;
+  prog->items = malloc(sizeof(Instr) * capacity);
+  assert(prog->items);
+}
+
+void program_push(Program *prog, Instr item) {
+  if (prog->size >= prog->capacity) {
+    prog->capacity = (prog->capacity == 0 ? 8 : prog->capacity * 2);
+    prog->items = realloc(prog->items, prog->capacity * sizeof(Instr));
+    assert(prog->items);
+  }
+  prog->items[prog->size++] = item;
+}
+
+void program_free(Program *prog) {
+  for (size_t i = 0; i < prog->size; i++) free(prog->items[i].symbol);
+  free(prog->items);
+}
+
+static int find_op(const char *name) {
+  for (int i = 0; op_names[i]; i++)
+    if (strcasecmp(name, op_names[i]) == 0) return i;
+  return -1;
+}
+
+// Parses $hex, %binary or decimal. *wide is set when the literal was written
+// with more digits than a zero page address needs.
+static int parse_number(const char *text, uint16_t *value, int *wide) {
+  int base = 10;
+  if (*text == '$') { base = 16; text++; }
+  else if (*text == '%') { base = 2; text++; }
+  if (!*text) return -1;
+
+  char *end;
+  unsigned long v = strtoul(text, &end, base);
+  if (*end || v > 0xFFFF) return -1;
+  *value = v;
+  size_t digits = strlen(text);
+  *wide = (v > U8_MAX) || (base == 16 && digits > 2) || (base == 2 && digits > 8);
+  return 0;
+}
+
+static int is_register(Token *tok, size_t i, const char *name) {
+  return tok->type[i] == TOKEN_IDENTIFIER && strcasecmp(tok->text[i], name) == 0;
+}
+
+static int parse_fail(unsigned int line, const char *what) {
+  snprintf(asm_error, sizeof asm_error, "line %u: %s", line, what);
+  return -1;
+}
+
+int parse_program(Token *tok, Program *prog) {
+  init_encode_table();
+  unsigned int line = 1;
+  size_t i = 0;
+
+  while (tok->type[i] != TOKEN_EOF) {
+    symbols type = tok->type[i];
+    if (type == TOKEN_NEWLINE) { line++; i++; continue; }
+    if (type == TOKEN_COMMENT) { i++; continue; }
+    if (type == TOKEN_LABEL) {
+      Instr label = {ITEM_LABEL, 0, 0, 0, strdup(tok->text[i]), 0, line};
+      program_push(prog, label);
+      i++;
+      continue;
+    }
+    if (type != TOKEN_IDENTIFIER) return parse_fail(line, "expected instruction");
+
+    int op = find_op(tok->text[i]);
+    if (op < 0) return parse_fail(line, "unknown mnemonic");
+    i++;
+
+    Instr in = {ITEM_INSTR, op, MODE_IMP, 0, NULL, 0, line};
+    int wide = 1, indirect = 0;
+    char index = 0;
+
+    if (tok->type[i] == TOKEN_IMMEDIATE) {
+      in.mode = MODE_IMM;
+      if (parse_number(tok->text[i] + 1, &in.value, &wide) != 0 || in.value > U8_MAX)
+        return parse_fail(line, "bad immediate");
+      i++;
+    } else if (is_register(tok, i, "A") && tok->type[i + 1] != TOKEN_COMMA) {
+      in.mode = MODE_ACC;
+      i++;
+    } else if (tok->type[i] == TOKEN_NUMBER || tok->type[i] == TOKEN_IDENTIFIER ||
+               tok->type[i] == TOKEN_LPAREN) {
+      if (tok->type[i] == TOKEN_LPAREN) { indirect = 1; i++; }
+      if (tok->type[i] == TOKEN_NUMBER) {
+        if (parse_number(tok->text[i], &in.value, &wide) != 0)
+          return parse_fail(line, "bad number");
+      } else if (tok->type[i] == TOKEN_IDENTIFIER) {
+        in.symbol = strdup(tok->text[i]);
+      } else {
+        return parse_fail(line, "expected operand");
+      }
+      i++;
+      if (indirect && tok->type[i] == TOKEN_COMMA && is_register(tok, i + 1, "X") &&
+          tok->type[i + 2] == TOKEN_RPAREN) {
+        index = 'X';
+        i += 3;
+      } else if (indirect) {
+        if (tok->type[i] != TOKEN_RPAREN) return parse_fail(line, "expected )");
+        i++;
+      }
+      if (tok->type[i] == TOKEN_COMMA) {
+        if (index) return parse_fail(line, "bad index");
+        if (is_register(tok, i + 1, "X")) index = 'X';
+        else if (is_register(tok, i + 1, "Y")) index = 'Y';
+        else return parse_fail(line, "bad index");
+        i += 2;
+      }
+
+      if (encode_table[op][MODE_REL] >= 0 && !indirect && !index) {
+        in.mode = MODE_REL;
+      } else if (indirect) {
+        if (index == 'X') in.mode = MODE_IZX;
+        else if (index == 'Y') in.mode = MODE_IZY;
+        else in.mode = MODE_IND;
+      } else {
+        static const uint8_t zp_modes[]  = {MODE_ZP,  MODE_ZPX, MODE_ZPY};
+        static const uint8_t abs_modes[] = {MODE_ABS, MODE_ABX, MODE_ABY};
+        int which = (index == 'X') ? 1 : (index == 'Y') ? 2 : 0;
+        in.mode = abs_modes[which];
+        if (!wide && !in.symbol && encode_table[op][zp_modes[which]] >= 0)
+          in.mode = zp_modes[which];
+      }
+    } else if (encode_table[op][MODE_IMP] < 0 && encode_table[op][MODE_ACC] >= 0) {
+      in.mode = MODE_ACC;
+    }
+
+    if (encode_table[op][in.mode] < 0) {
+      free(in.symbol);
+      return parse_fail(line, "addressing mode not available");
+    }
+    if ((in.mode == MODE_IZX || in.mode == MODE_IZY) && (wide || in.symbol)) {
+      free(in.symbol);
+      return parse_fail(line, "indirect pointer must be in zero page");
+    }
+    program_push(prog, in);
+
+    if (tok->type[i] == TOKEN_COMMENT) i++;
+    if (tok->type[i] != TOKEN_NEWLINE && tok->type[i] != TOKEN_EOF)
+      return parse_fail(line, "unexpected token after operand");
+  }
+  return 0;
+}
+
+static int find_label(Program *prog, const char *name, uint16_t *addr) {
+  for (size_t i = 0; i < prog->size; i++)
+    if (prog->items[i].kind == ITEM_LABEL && strcmp(prog->items[i].symbol, name) == 0) {
+      *addr = prog->items[i].addr;
+      return 0;
+    }
+  return -1;
+}
+
+// Gives every item its address when laid out from origin and returns the
+// address just past the last instruction.
+static uint32_t layout_program(Program *prog, uint16_t origin) {
+  uint32_t pc = origin;
+  for (size_t i = 0; i < prog->size; i++) {
+    prog->items[i].addr = pc;
+    if (prog->items[i].kind == ITEM_INSTR) pc += mode_sizes[prog->items[i].mode];
+  }
+  return pc;
+}
+
+// Lays out prog from origin and encodes it into out, which must have room
+// for 64K. *len receives the number of bytes written.
+int assemble_program(Program *prog, uint16_t origin, uint8_t *out, size_t *len) {
+  init_encode_table();
+  if (layout_program(prog, origin) > 0x10000) return parse_fail(0, "program does not fit in 64K");
+
+  size_t n = 0;
+  for (size_t i = 0; i < prog->size; i++) {
+    Instr *in = &prog->items[i];
+    if (in->kind != ITEM_INSTR) continue;
+    if (in->symbol && find_label(prog, in->symbol, &in->value) != 0)
+      return parse_fail(in->line, "undefined label");
+
+    out[n++] = encode_table[in->op][in->mode];
+    if (in->mode == MODE_REL) {
+      int offset = in->value - (in->addr + 2);
+      if (offset < -128 || offset > 127) return parse_fail(in->line, "branch out of range");
+      out[n++] = offset & U8_MAX;
+    } else if (mode_sizes[in->mode] == 2) {
+      out[n++] = in->value & U8_MAX;
+    } else if (mode_sizes[in->mode] == 3) {
+      out[n++] = in->value & U8_MAX;
+      out[n++] = in->value >> 8;
+    }
+  }
+  *len = n;
+  return 0;
+}
+
+int assemble(const char *src, uint16_t origin, uint8_t *out, size_t *len) {
+  Token tok = tokenize_all(src);
+  Program prog;
+  program_init(&prog, 64);
+  int result = parse_program(&tok, &prog);
+  if (result == 0) result = assemble_program(&prog, origin, out, len);
+  program_free(&prog);
+  token_free(&tok);
+  return result;
+}
+
+#endif // ASSEMBLER_C
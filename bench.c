@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <time.h>
+#include "assembler.c"
+#include "loader.c"
+
+// Benchmarks the emulator on the programs in bench/ and the lexer and
+// assembler on their sources. Every program is assembled at $0600, checked
+// against its known result once, then rerun until enough time has passed.
+// A summary goes to stdout and the numbers to a JSON file (default
+// bench_results.json) for comparing versions.
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define BENCH_ORIGIN   0x0600
+#define BENCH_MIN_NS   250000000ULL
+
+typedef struct {
+  const char *name;
+  const char *path;
+  uint16_t result_addr;
+  uint8_t expected[3];
+  size_t expected_len;
+} bench_program;
+
+static const bench_program programs[] = {
+  {"functional", "bench/functional.s", 0x0200, {0xAA},             1},
+  {"sieve",      "bench/sieve.s",      0x0200, {0x04, 0x04},       2},
+  {"memcpy",     "bench/memcpy.s",     0x0200, {0x01},             1},
+  {"bcd",        "bench/bcd.s",        0x0200, {0x00, 0x77, 0x00}, 3},
+  {"sort",       "bench/sort.s",       0x0200, {0x01},             1},
+};
+#define PROGRAM_COUNT (sizeof programs / sizeof programs[0])
+
+typedef struct {
+  uint64_t instructions;
+  uint64_t cycles;
+  uint64_t ns;
+  int ok;
+} bench_result;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void start_program(cpu6502 *cpu) {
+  cpu->PC = BENCH_ORIGIN;
+  cpu->SP = 0xFF;
+  cpu->P.D = 0;
+  cpu->P.I = 0;
+  cpu->cycles = 0;
+  cpu->stop = STOP_NONE;
+}
+
+static bench_result run_program(const bench_program *p, const char *src) {
+  bench_result r = {0, 0, 0, 0};
+  static uint8_t image[0x10000];
+  size_t len;
+
+  reset_cpu();
+  if (assemble(src, BENCH_ORIGIN, image, &len) != 0) {
+    fprintf(stderr, "%s: %s\n", p->path, asm_error);
+    return r;
+  }
+  memcpy(memory + BENCH_ORIGIN, image, len);
+
+  start_program(&default_cpu);
+  run(UINT64_MAX);
+  r.ok = (default_cpu.stop == STOP_BRK &&
+          memcmp(memory + p->result_addr, p->expected, p->expected_len) == 0);
+  if (!r.ok) return r;
+
+  uint64_t start = now_ns();
+  do {
+    start_program(&default_cpu);
+    r.instructions += run(UINT64_MAX);
+    r.cycles += default_cpu.cycles;
+    r.ns = now_ns() - start;
+  } while (r.ns < BENCH_MIN_NS);
+  return r;
+}
+
+// Returns MB/s for lexing (assemble == 0) or assembling all sources.
+static double text_throughput(char **sources, int assemble_too) {
+  static uint8_t image[0x10000];
+  uint64_t bytes = 0, start = now_ns(), ns;
+  do {
+    for (size_t i = 0; i < PROGRAM_COUNT; i++) {
+      if (assemble_too) {
+        size_t len;
+        assemble(sources[i], BENCH_ORIGIN, image, &len);
+      } else {
+        Token tok = tokenize_all(sources[i]);
+        token_free(&tok);
+      }
+      bytes += strlen(sources[i]);
+    }
+    ns = now_ns() - start;
+  } while (ns < BENCH_MIN_NS);
+  return bytes / (ns / 1e9) / 1e6;
+}
+
+int main(int argc, char **argv) {
+  const char *out_path = argc > 1 ? argv[1] : "bench_results.json";
+  char *sources[PROGRAM_COUNT];
+  bench_result results[PROGRAM_COUNT];
+  int failed = 0;
+
+  for (size_t i = 0; i < PROGRAM_COUNT; i++) {
+    uint8_t *text;
+    size_t size;
+    if (read_whole_file(programs[i].path, &text, &size) != 0) {
+      fprintf(stderr, "cannot read %s (run from the repository root)\n", programs[i].path);
+      return 1;
+    }
+    sources[i] = (char *)text;
+  }
+
+  printf("%-12s %14s %10s %10s %14s\n", "program", "instructions", "ns/instr",
+         "MHz", "instr/s");
+  for (size_t i = 0; i < PROGRAM_COUNT; i++) {
+    bench_result *r = &results[i];
+    *r = run_program(&programs[i], sources[i]);
+    if (!r->ok) {
+      printf("%-12s FAILED\n", programs[i].name);
+      failed = 1;
+      continue;
+    }
+    double secs = r->ns / 1e9;
+    printf("%-12s %14llu %10.2f %10.1f %14.0f\n", programs[i].name,
+           (unsigned long long)r->instructions, (double)r->ns / r->instructions,
+           r->cycles / secs / 1e6, r->instructions / secs);
+  }
+
+  double lex_mbs = text_throughput(sources, 0);
+  double asm_mbs = text_throughput(sources, 1);
+  printf("\nlexer     %8.2f MB/s\nassembler %8.2f MB/s\n", lex_mbs, asm_mbs);
+
+  FILE *f = fopen(out_path, "w");
+  if (!f) {
+    fprintf(stderr, "cannot write %s\n", out_path);
+    return 1;
+  }
+  fprintf(f, "{\n  \"version\": \"%s\",\n  \"programs\": [\n", BENCH_VERSION);
+  for (size_t i = 0; i < PROGRAM_COUNT; i++) {
+    bench_result *r = &results[i];
+    double secs = r->ns / 1e9;
+    fprintf(f, "    {\"name\": \"%s\", \"ok\": %s", programs[i].name,
+            r->ok ? "true" : "false");
+    if (r->ok)
+      fprintf(f, ", \"instructions\": %llu, \"cycles\": %llu, \"ns\": %llu, "
+                 "\"ns_per_instruction\": %.3f, \"emulated_mhz\": %.3f, "
+                 "\"instructions_per_second\": %.0f",
+              (unsigned long long)r->instructions, (unsigned long long)r->cycles,
+              (unsigned long long)r->ns, (double)r->ns / r->instructions,
+              r->cycles / secs / 1e6, r->instructions / secs);
+    fprintf(f, "}%s\n", i + 1 < PROGRAM_COUNT ? "," : "");
+  }
+  fprintf(f, "  ],\n  \"lexer_mb_per_second\": %.3f,\n"
+             "  \"assembler_mb_per_second\": %.3f\n}\n", lex_mbs, asm_mbs);
+  fclose(f);
+
+  for (size_t i = 0; i < PROGRAM_COUNT; i++) free(sources[i]);
+  return failed;
+}
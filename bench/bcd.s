@@ -0,0 +1,48 @@
+; Decimal mode arithmetic on a 3 byte BCD counter in $20-$22: count up
+; 10000 times with ADC, then down 2300 times with SBC. The result, 007700,
+; is copied to $0200-$0202 low byte first.
+        SED
+        LDA #$00
+        STA $20
+        STA $21
+        STA $22
+        LDY #100
+up:     LDX #100
+upstep: CLC
+        LDA $20
+        ADC #$01
+        STA $20
+        LDA $21
+        ADC #$00
+        STA $21
+        LDA $22
+        ADC #$00
+        STA $22
+        DEX
+        BNE upstep
+        DEY
+        BNE up
+        LDY #23
+down:   LDX #100
+dnstep: SEC
+        LDA $20
+        SBC #$01
+        STA $20
+        LDA $21
+        SBC #$00
+        STA $21
+        LDA $22
+        SBC #$00
+        STA $22
+        DEX
+        BNE dnstep
+        DEY
+        BNE down
+        CLD
+        LDA $20
+        STA $0200
+        LDA $21
+        STA $0201
+        LDA $22
+        STA $0202
+        BRK
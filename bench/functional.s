@@ -0,0 +1,665 @@
+; Self-checking instruction test in the spirit of a functional test ROM.
+; Each test starts with C and V clear and leaves a result in A and the
+; flags. On success $0200 = $AA, on failure $0200 = $EE and $0201 holds
+; the number of the failing test.
+        CLD
+        LDX #$FF
+        TXS
+        LDA #$00
+        STA $02
+; test 1
+        INC $02
+        CLC
+        CLV
+        LDA #$80
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$80
+        BEQ flags1
+        JMP fail
+flags1: TXA
+        CMP #$80
+        BEQ pass1
+        JMP fail
+pass1: NOP
+; test 2
+        INC $02
+        CLC
+        CLV
+        LDA #$00
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$02
+        BEQ flags2
+        JMP fail
+flags2: TXA
+        CMP #$00
+        BEQ pass2
+        JMP fail
+pass2: NOP
+; test 3
+        INC $02
+        CLC
+        CLV
+        CLC
+        LDA #$50
+        ADC #$50
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$C0
+        BEQ flags3
+        JMP fail
+flags3: TXA
+        CMP #$A0
+        BEQ pass3
+        JMP fail
+pass3: NOP
+; test 4
+        INC $02
+        CLC
+        CLV
+        SEC
+        LDA #$FF
+        ADC #$00
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$03
+        BEQ flags4
+        JMP fail
+flags4: TXA
+        CMP #$00
+        BEQ pass4
+        JMP fail
+pass4: NOP
+; test 5
+        INC $02
+        CLC
+        CLV
+        SEC
+        LDA #$50
+        SBC #$F0
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$00
+        BEQ flags5
+        JMP fail
+flags5: TXA
+        CMP #$60
+        BEQ pass5
+        JMP fail
+pass5: NOP
+; test 6
+        INC $02
+        CLC
+        CLV
+        SEC
+        LDA #$50
+        SBC #$B0
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$C0
+        BEQ flags6
+        JMP fail
+flags6: TXA
+        CMP #$A0
+        BEQ pass6
+        JMP fail
+pass6: NOP
+; test 7
+        INC $02
+        CLC
+        CLV
+        SED
+        CLC
+        LDA #$58
+        ADC #$46
+        CLD
+        PHP
+        TAX
+        PLA
+        AND #$03
+        CMP #$01
+        BEQ flags7
+        JMP fail
+flags7: TXA
+        CMP #$04
+        BEQ pass7
+        JMP fail
+pass7: NOP
+; test 8
+        INC $02
+        CLC
+        CLV
+        SED
+        SEC
+        LDA #$12
+        SBC #$21
+        CLD
+        PHP
+        TAX
+        PLA
+        AND #$03
+        CMP #$00
+        BEQ flags8
+        JMP fail
+flags8: TXA
+        CMP #$91
+        BEQ pass8
+        JMP fail
+pass8: NOP
+; test 9
+        INC $02
+        CLC
+        CLV
+        LDA #$F0
+        AND #$3C
+        ORA #$01
+        EOR #$FF
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$80
+        BEQ flags9
+        JMP fail
+flags9: TXA
+        CMP #$CE
+        BEQ pass9
+        JMP fail
+pass9: NOP
+; test 10
+        INC $02
+        CLC
+        CLV
+        LDA #$81
+        ASL A
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$01
+        BEQ flags10
+        JMP fail
+flags10: TXA
+        CMP #$02
+        BEQ pass10
+        JMP fail
+pass10: NOP
+; test 11
+        INC $02
+        CLC
+        CLV
+        LDA #$01
+        LSR A
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$03
+        BEQ flags11
+        JMP fail
+flags11: TXA
+        CMP #$00
+        BEQ pass11
+        JMP fail
+pass11: NOP
+; test 12
+        INC $02
+        CLC
+        CLV
+        SEC
+        LDA #$40
+        ROL A
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$80
+        BEQ flags12
+        JMP fail
+flags12: TXA
+        CMP #$81
+        BEQ pass12
+        JMP fail
+pass12: NOP
+; test 13
+        INC $02
+        CLC
+        CLV
+        SEC
+        LDA #$02
+        ROR A
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$80
+        BEQ flags13
+        JMP fail
+flags13: TXA
+        CMP #$81
+        BEQ pass13
+        JMP fail
+pass13: NOP
+; test 14
+        INC $02
+        CLC
+        CLV
+        LDA #$C0
+        STA $40
+        ASL $40
+        ROL $40
+        LDA $40
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$01
+        BEQ flags14
+        JMP fail
+flags14: TXA
+        CMP #$01
+        BEQ pass14
+        JMP fail
+pass14: NOP
+; test 15
+        INC $02
+        CLC
+        CLV
+        LDA #$FF
+        STA $0300
+        INC $0300
+        LDA $0300
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$02
+        BEQ flags15
+        JMP fail
+flags15: TXA
+        CMP #$00
+        BEQ pass15
+        JMP fail
+pass15: NOP
+; test 16
+        INC $02
+        CLC
+        CLV
+        LDA #$00
+        STA $41
+        DEC $41
+        LDA $41
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$80
+        BEQ flags16
+        JMP fail
+flags16: TXA
+        CMP #$FF
+        BEQ pass16
+        JMP fail
+pass16: NOP
+; test 17
+        INC $02
+        CLC
+        CLV
+        LDX #$FF
+        INX
+        TXA
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$02
+        BEQ flags17
+        JMP fail
+flags17: TXA
+        CMP #$00
+        BEQ pass17
+        JMP fail
+pass17: NOP
+; test 18
+        INC $02
+        CLC
+        CLV
+        LDY #$00
+        DEY
+        TYA
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$80
+        BEQ flags18
+        JMP fail
+flags18: TXA
+        CMP #$FF
+        BEQ pass18
+        JMP fail
+pass18: NOP
+; test 19
+        INC $02
+        CLC
+        CLV
+        LDA #$40
+        CMP #$41
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$80
+        BEQ flags19
+        JMP fail
+flags19: TXA
+        CMP #$40
+        BEQ pass19
+        JMP fail
+pass19: NOP
+; test 20
+        INC $02
+        CLC
+        CLV
+        LDX #$41
+        CPX #$40
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$01
+        BEQ flags20
+        JMP fail
+flags20: TXA
+; test 21
+        INC $02
+        CLC
+        CLV
+        LDY #$33
+        CPY #$33
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$03
+        BEQ flags21
+        JMP fail
+flags21: TXA
+; test 22
+        INC $02
+        CLC
+        CLV
+        LDA #$C0
+        STA $42
+        LDA #$01
+        BIT $42
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$C2
+        BEQ flags22
+        JMP fail
+flags22: TXA
+        CMP #$01
+        BEQ pass22
+        JMP fail
+pass22: NOP
+; test 23
+        INC $02
+        CLC
+        CLV
+        LDA #$77
+        LDX #$05
+        STA $50,X
+        LDA #$00
+        LDA $55
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$00
+        BEQ flags23
+        JMP fail
+flags23: TXA
+        CMP #$77
+        BEQ pass23
+        JMP fail
+pass23: NOP
+; test 24
+        INC $02
+        CLC
+        CLV
+        LDA #$66
+        LDY #$10
+        STA $0300,Y
+        LDA #$00
+        LDA $0310
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$00
+        BEQ flags24
+        JMP fail
+flags24: TXA
+        CMP #$66
+        BEQ pass24
+        JMP fail
+pass24: NOP
+; test 25
+        INC $02
+        CLC
+        CLV
+        LDA #$00
+        STA $60
+        LDA #$03
+        STA $61
+        LDY #$20
+        LDA #$55
+        STA ($60),Y
+        LDA #$00
+        LDA $0320
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$00
+        BEQ flags25
+        JMP fail
+flags25: TXA
+        CMP #$55
+        BEQ pass25
+        JMP fail
+pass25: NOP
+; test 26
+        INC $02
+        CLC
+        CLV
+        LDA #$20
+        STA $62
+        LDA #$03
+        STA $63
+        LDX #$02
+        LDA ($60,X)
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$00
+        BEQ flags26
+        JMP fail
+flags26: TXA
+        CMP #$55
+        BEQ pass26
+        JMP fail
+pass26: NOP
+; test 27
+        INC $02
+        CLC
+        CLV
+        LDA #$99
+        STA $0400
+        LDX #$01
+        LDA $03FF,X
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$80
+        BEQ flags27
+        JMP fail
+flags27: TXA
+        CMP #$99
+        BEQ pass27
+        JMP fail
+pass27: NOP
+; test 28
+        INC $02
+        CLC
+        CLV
+        LDA #$12
+        PHA
+        LDA #$34
+        PHA
+        PLA
+        PLA
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$00
+        BEQ flags28
+        JMP fail
+flags28: TXA
+        CMP #$12
+        BEQ pass28
+        JMP fail
+pass28: NOP
+; test 29
+        INC $02
+        CLC
+        CLV
+        SEC
+        PHP
+        CLC
+        PLP
+        PHP
+        TAX
+        PLA
+        AND #$01
+        CMP #$01
+        BEQ flags29
+        JMP fail
+flags29: TXA
+; test 30
+        INC $02
+        CLC
+        CLV
+        LDX #$80
+        TXS
+        TSX
+        TXA
+        LDX #$FF
+        TXS
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$80
+        BEQ flags30
+        JMP fail
+flags30: TXA
+        CMP #$80
+        BEQ pass30
+        JMP fail
+pass30: NOP
+; test 31
+        INC $02
+        CLC
+        CLV
+        LDA #$00
+        JSR sub
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$00
+        BEQ flags31
+        JMP fail
+flags31: TXA
+        CMP #$42
+        BEQ pass31
+        JMP fail
+pass31: NOP
+; test 32
+        INC $02
+        CLC
+        CLV
+        LDX #$00
+        LDA #$00
+loop32: CLC
+        ADC #$03
+        INX
+        CPX #$05
+        BNE loop32
+        PHP
+        TAX
+        PLA
+        AND #$C3
+        CMP #$03
+        BEQ flags32
+        JMP fail
+flags32: TXA
+        CMP #$0F
+        BEQ pass32
+        JMP fail
+pass32: NOP
+; test 33
+        INC $02
+        CLC
+        CLV
+        CLC
+        LDA #$7F
+        ADC #$01
+        LDA #$00
+        BVC skip33
+        LDA #$01
+skip33: NOP
+        PHP
+        TAX
+        PLA
+        AND #$C2
+        CMP #$40
+        BEQ flags33
+        JMP fail
+flags33: TXA
+        CMP #$01
+        BEQ pass33
+        JMP fail
+pass33: NOP
+        LDX #$FF
+        TXS
+        LDA #$AA
+        STA $0200
+        BRK
+fail:   LDA #$EE
+        STA $0200
+        LDA $02
+        STA $0201
+        BRK
+sub:    LDA #$42
+        RTS
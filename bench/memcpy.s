@@ -0,0 +1,64 @@
+; memset and memcpy loops over 8K blocks through (zp),Y pointers: fill
+; $2000-$3FFF with a pattern, copy it to $4000, set $6000-$7FFF to $FF and
+; compare the copy. $0200 = $01 when everything matches.
+        LDA #$00
+        STA $10
+        STA $12
+        LDA #$20
+        STA $11
+        LDA #$40
+        STA $13
+        LDX #$20
+        LDY #$00
+fill:   TYA
+        EOR $11
+        STA ($10),Y
+        INY
+        BNE fill
+        INC $11
+        DEX
+        BNE fill
+        LDA #$20
+        STA $11
+        LDX #$20
+copy:   LDA ($10),Y
+        STA ($12),Y
+        INY
+        BNE copy
+        INC $11
+        INC $13
+        DEX
+        BNE copy
+        LDA #$60
+        STA $13
+        LDA #$FF
+        LDX #$20
+set:    STA ($12),Y
+        INY
+        BNE set
+        INC $13
+        DEX
+        BNE set
+        LDA #$20
+        STA $11
+        LDA #$40
+        STA $13
+        LDX #$20
+compare: LDA ($10),Y
+        CMP ($12),Y
+        BNE bad
+        INY
+        BNE compare
+        INC $11
+        INC $13
+        DEX
+        BNE compare
+        LDA $7FFF
+        CMP #$FF
+        BNE bad
+        LDA #$01
+        STA $0200
+        BRK
+bad:    LDA #$00
+        STA $0200
+        BRK
@@ -0,0 +1,64 @@
+; Sieve of Eratosthenes over 0..8191 with the flags at $2000-$3FFF.
+; The prime count ends up in $0200/$0201 (1028 = $0404).
+        LDA #$00
+        STA $10
+        LDA #$20
+        STA $11
+        LDY #$00
+        LDX #$20
+        LDA #$00
+clear:  STA ($10),Y
+        INY
+        BNE clear
+        INC $11
+        DEX
+        BNE clear
+        STA $16
+        STA $17
+        LDA #$02
+        STA $12
+        LDA #$00
+        STA $13
+outer:  LDA $12
+        STA $18
+        LDA $13
+        CLC
+        ADC #$20
+        STA $19
+        LDY #$00
+        LDA ($18),Y
+        BNE next
+        INC $16
+        BNE counted
+        INC $17
+counted: LDA $18
+        CLC
+        ADC $12
+        STA $14
+        LDA $19
+        ADC $13
+        STA $15
+mark:   LDA $15
+        CMP #$40
+        BCS next
+        LDA #$01
+        STA ($14),Y
+        LDA $14
+        CLC
+        ADC $12
+        STA $14
+        LDA $15
+        ADC $13
+        STA $15
+        JMP mark
+next:   INC $12
+        BNE limit
+        INC $13
+limit:  LDA $13
+        CMP #$20
+        BCC outer
+        LDA $16
+        STA $0200
+        LDA $17
+        STA $0201
+        BRK
@@ -0,0 +1,46 @@
+; Bubble sort of 256 pseudo-random bytes at $2000, generated by an 8 bit
+; Galois LFSR. $0200 = $01 when the array checks out ascending.
+        LDA #$5A
+        STA $30
+        LDX #$00
+gen:    LDA $30
+        ASL A
+        BCC nofb
+        EOR #$1D
+nofb:   STA $30
+        STA $2000,X
+        INX
+        BNE gen
+pass:   LDA #$00
+        STA $31
+        LDX #$00
+scan:   LDA $2000,X
+        CMP $2001,X
+        BCC inorder
+        BEQ inorder
+        TAY
+        LDA $2001,X
+        STA $2000,X
+        TYA
+        STA $2001,X
+        LDA #$01
+        STA $31
+inorder: INX
+        CPX #$FF
+        BNE scan
+        LDA $31
+        BNE pass
+        LDX #$00
+check:  LDA $2000,X
+        CMP $2001,X
+        BEQ next
+        BCS bad
+next:   INX
+        CPX #$FF
+        BNE check
+        LDA #$01
+        STA $0200
+        BRK
+bad:    LDA #$00
+        STA $0200
+        BRK
@@ -1,5 +1,7 @@
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
+#ifndef CPU_C
+#define CPU_C
+
+#include <stdint.h>
 
 typedef uint8_t reg8_t;
 typedef uint16_t reg16_t;
@@ -24,6 +26,13 @@ struct Status {
   uint8_t N:1;
 };
 
+// Why run_c() returned.
+typedef enum {
+  STOP_NONE, STOP_BRK, STOP_ILLEGAL, STOP_BREAKPOINT,
+  STOP_WATCH_READ, STOP_WATCH_WRITE,
+  STOP_IO // I was cleared while a device interrupt waited, see run_devices_c()
+} stop_reason;
+
 typedef struct {
   regA_t  A;
   regX_t  X;
@@ -31,11 +40,160 @@ typedef struct {
   regSP_t SP;
   regPC_t PC;
   struct Status P;
+  uint64_t cycles;
+  uint8_t stop; // stop_reason
 } cpu6502;
 
 static uint8_t memory[0x10000];
 static cpu6502 default_cpu = {0};
 
+// Breakpoints and watchpoints are kept as one bit per address. page_flags
+// summarises each 256-byte page so that accesses to pages without a watch,
+// a ROM mapping or a device only pay for a single byte test before touching
+// memory.
+#define WATCH_READ  0x01
+#define WATCH_WRITE 0x02
+#define PAGE_ROM    0x04
+#define PAGE_IO     0x08
+
+#define MAP_TEST(map, addr) (((map)[(addr) >> 6] >> ((addr) & 63)) & 1)
+#define MAP_SET(map, addr)  ((map)[(addr) >> 6] |= (uint64_t)1 << ((addr) & 63))
+#define MAP_CLR(map, addr)  ((map)[(addr) >> 6] &= ~((uint64_t)1 << ((addr) & 63)))
+
+static uint64_t break_map[0x10000 / 64];
+static uint64_t watch_read_map[0x10000 / 64];
+static uint64_t watch_write_map[0x10000 / 64];
+static uint8_t  page_flags[0x100];
+static unsigned int break_count = 0;
+static uint16_t watch_hit_addr = 0;
+
+// Where each page is read from: memory itself unless a read-only image
+// (see loader.c) is mapped over it. Writes to ROM pages are dropped.
+#define RAM_PAGE(n)      memory + (n) * 0x100
+#define RAM_PAGES4(n)    RAM_PAGE(n), RAM_PAGE(n + 1), RAM_PAGE(n + 2), RAM_PAGE(n + 3)
+#define RAM_PAGES16(n)   RAM_PAGES4(n), RAM_PAGES4(n + 4), RAM_PAGES4(n + 8), RAM_PAGES4(n + 12)
+#define RAM_PAGES64(n)   RAM_PAGES16(n), RAM_PAGES16(n + 16), RAM_PAGES16(n + 32), RAM_PAGES16(n + 48)
+static const uint8_t *read_pages[0x100] = {
+  RAM_PAGES64(0), RAM_PAGES64(64), RAM_PAGES64(128), RAM_PAGES64(192)
+};
+
+void map_rom_pages(uint8_t page, unsigned int count, const uint8_t *data){
+  for (unsigned int i = 0; i < count; i++) {
+    read_pages[page + i] = data + i * 0x100;
+    page_flags[page + i] |= PAGE_ROM;
+  }
+}
+
+void unmap_rom_pages(uint8_t page, unsigned int count){
+  for (unsigned int i = 0; i < count; i++) {
+    read_pages[page + i] = RAM_PAGE(page + i);
+    page_flags[page + i] &= ~PAGE_ROM;
+  }
+}
+
+// Accesses to PAGE_IO pages go to these hooks (see devices.c) along with
+// the cycle count the accessing instruction ends on.
+static uint8_t (*io_read)(uint16_t addr, uint64_t cycle);
+static void (*io_write)(uint16_t addr, uint8_t value, uint64_t cycle);
+
+// Set by run_devices_c() while an interrupt request waits for I to clear;
+// CLI, PLP and RTI then end the run with STOP_IO when they clear it.
+static int irq_waiting = 0;
+
+void map_io_pages(uint8_t page, unsigned int count){
+  for (unsigned int i = 0; i < count; i++) page_flags[page + i] |= PAGE_IO;
+}
+
+void unmap_io_pages(uint8_t page, unsigned int count){
+  for (unsigned int i = 0; i < count; i++) page_flags[page + i] &= ~PAGE_IO;
+}
+
+void set_breakpoint(uint16_t addr){
+  if (!MAP_TEST(break_map, addr)) break_count++;
+  MAP_SET(break_map, addr);
+}
+
+void clear_breakpoint(uint16_t addr){
+  if (MAP_TEST(break_map, addr)) break_count--;
+  MAP_CLR(break_map, addr);
+}
+
+static void update_page_flags(uint8_t page){
+  uint8_t flags = 0;
+  for (int w = page * 4; w < page * 4 + 4; w++) {
+    if (watch_read_map[w])  flags |= WATCH_READ;
+    if (watch_write_map[w]) flags |= WATCH_WRITE;
+  }
+  page_flags[page] = (page_flags[page] & ~(WATCH_READ | WATCH_WRITE)) | flags;
+}
+
+// kind is WATCH_READ, WATCH_WRITE or both.
+void set_watchpoint(uint16_t addr, uint8_t kind){
+  if (kind & WATCH_READ)  MAP_SET(watch_read_map, addr);
+  if (kind & WATCH_WRITE) MAP_SET(watch_write_map, addr);
+  update_page_flags(addr >> 8);
+}
+
+void clear_watchpoint(uint16_t addr, uint8_t kind){
+  if (kind & WATCH_READ)  MAP_CLR(watch_read_map, addr);
+  if (kind & WATCH_WRITE) MAP_CLR(watch_write_map, addr);
+  update_page_flags(addr >> 8);
+}
+
+void clear_all_debug(void){
+  for (int i = 0; i < 0x10000 / 64; i++) {
+    break_map[i] = 0;
+    watch_read_map[i] = 0;
+    watch_write_map[i] = 0;
+  }
+  for (int page = 0; page < 0x100; page++) update_page_flags(page);
+  break_count = 0;
+}
+
+// The slow paths report watch hits instead of writing to the cpu so that
+// the run loop's copy of the registers never has its address taken.
+static __attribute__((noinline)) uint8_t read_mem_slow(uint16_t addr, uint64_t cycle,
+                                                       uint8_t *stop){
+  if (MAP_TEST(watch_read_map, addr)) {
+    *stop = STOP_WATCH_READ;
+    watch_hit_addr = addr;
+  }
+  if (page_flags[addr >> 8] & PAGE_IO) return io_read(addr, cycle);
+  return read_pages[addr >> 8][addr & U8_MAX];
+}
+
+static __attribute__((noinline)) uint8_t write_mem_slow(uint16_t addr, uint8_t value,
+                                                        uint64_t cycle){
+  if (page_flags[addr >> 8] & PAGE_IO) io_write(addr, value, cycle);
+  else if (!(page_flags[addr >> 8] & PAGE_ROM)) memory[addr] = value;
+  if (MAP_TEST(watch_write_map, addr)) {
+    watch_hit_addr = addr;
+    return STOP_WATCH_WRITE;
+  }
+  return STOP_NONE;
+}
+
+#define read_mem(addr) read_mem_c(&default_cpu, addr)
+static inline uint8_t read_mem_c(cpu6502 *cpu, uint16_t addr){
+  if (__builtin_expect(page_flags[addr >> 8] != 0, 0)) {
+    uint8_t stop = STOP_NONE;
+    uint8_t value = read_mem_slow(addr, cpu->cycles, &stop);
+    if (stop) cpu->stop = stop;
+    return value;
+  }
+  return memory[addr];
+}
+
+#define write_mem(addr, value) write_mem_c(&default_cpu, addr, value)
+static inline void write_mem_c(cpu6502 *cpu, uint16_t addr, uint8_t value){
+  if (__builtin_expect(page_flags[addr >> 8] != 0, 0)) {
+    uint8_t stop = write_mem_slow(addr, value, cpu->cycles);
+    if (stop) cpu->stop = stop;
+  } else {
+    memory[addr] = value;
+  }
+}
+
 #define reset_cpu() reset_cpu_c(&default_cpu)
 void reset_cpu_c(cpu6502 *cpu) {
   cpu->A = 0;
@@ -53,20 +211,39 @@ void reset_cpu_c(cpu6502 *cpu) {
   cpu->P.V = 0;
   cpu->P.N = 0;
 
+  cpu->cycles = 0;
+  cpu->stop = STOP_NONE;
+
   for (int i = 0; i < 0x10000; i++) memory[i] = 0;
 }
 
+#define status_to_byte(P) status_to_byte_c(P)
+uint8_t status_to_byte_c(struct Status P){
+  return (P.C << 0) | (P.Z << 1) | (P.I << 2) | (P.D << 3) |
+         (P.B << 4) | (P.U << 5) | (P.V << 6) | (P.N << 7);
+}
+
+#define status_from_byte(P, value) status_from_byte_c(P, value)
+void status_from_byte_c(struct Status *P, uint8_t value){
+  P->C = (value >> 0) & 1;
+  P->Z = (value >> 1) & 1;
+  P->I = (value >> 2) & 1;
+  P->D = (value >> 3) & 1;
+  P->V = (value >> 6) & 1;
+  P->N = (value >> 7) & 1;
+}
+
 
 #define push(value) push_c(&default_cpu, value)
 void push_c(cpu6502 *cpu, uint8_t value){
-  memory[0x0100 | cpu->SP] = value;
+  write_mem_c(cpu, 0x0100 | cpu->SP, value);
   cpu->SP--;
 }
 
 #define pull() pull_c(&default_cpu)
 uint8_t pull_c(cpu6502 *cpu){
   cpu->SP++;
-  return memory[0x0100 | cpu->SP];
+  return read_mem_c(cpu, 0x0100 | cpu->SP);
 }
 
 #define ADC(M) ADC_c(&default_cpu, M)
@@ -74,6 +251,22 @@ void ADC_c(cpu6502 *cpu, uint8_t M){
   // C Z V N affected
   uint16_t sum = cpu->A + M + (cpu->P.C ? 1 : 0);
 
+  if (cpu->P.D) {
+    // NMOS decimal mode: Z comes from the binary sum, N and V from the
+    // result after the low digit fixup but before the high digit one.
+    int lo = (cpu->A & 0x0F) + (M & 0x0F) + cpu->P.C;
+    if (lo >= 0x0A) lo = ((lo + 0x06) & 0x0F) + 0x10;
+    int bcd = (cpu->A & 0xF0) + (M & 0xF0) + lo;
+
+    cpu->P.Z = ((sum & U8_MAX) == 0);
+    cpu->P.N = (bcd & 0x80) != 0;
+    cpu->P.V = (~(cpu->A ^ M) & (cpu->A ^ bcd) & 0x80) != 0;
+    if (bcd >= 0xA0) bcd += 0x60;
+    cpu->P.C = (bcd > U8_MAX);
+    cpu->A = bcd;
+    return;
+  }
+
   cpu->P.C = (sum > U8_MAX);
   cpu->P.V = (~(cpu->A ^ M) & (cpu->A ^ sum) & 0x80) != 0;
 
@@ -91,24 +284,48 @@ void AND_c(cpu6502 *cpu, uint8_t M){
   cpu->P.N = (cpu->A & 0x80) != 0;
 }
 
+#define ASL(addr) ASL_c(&default_cpu, addr)
+void ASL_c(cpu6502 *cpu, uint16_t addr){
+  // C Z N affected
+  uint8_t value = read_mem_c(cpu, addr);
+  cpu->P.C = (value & 0x80) != 0;
+  value = (value << 1) & U8_MAX;
+
+  write_mem_c(cpu, addr, value);
+  cpu->P.Z = (value == 0);
+  cpu->P.N = (value & 0x80) != 0;
+}
+
+#define ASL_A() ASL_A_c(&default_cpu)
+void ASL_A_c(cpu6502 *cpu){
+  // C Z N affected
+  cpu->P.C = (cpu->A & 0x80) != 0;
+  cpu->A = (cpu->A << 1) & U8_MAX;
+  cpu->P.Z = (cpu->A == 0);
+  cpu->P.N = (cpu->A & 0x80) != 0;
+}
+
 #define BRK() BRK_c(&default_cpu)
 void BRK_c(cpu6502 *cpu){
   cpu->P.B = 1;
 }
 
 #define BCC(offset) BCC_c(&default_cpu, offset)
-void BCC_c(cpu6502 *cpu, uint8_t offset){
-  if (!cpu->P.C) cpu->PC += offset;
+int BCC_c(cpu6502 *cpu, uint8_t offset){
+  if (!cpu->P.C) cpu->PC += (int8_t)offset;
+  return !cpu->P.C;
 }
 
-#define BCS(offset) BSC_c(&default_cpu, offset)
-void BCS_c(cpu6502 *cpu, uint8_t offset){
-  if (cpu->P.C == 1) cpu->PC += offset;
+#define BCS(offset) BCS_c(&default_cpu, offset)
+int BCS_c(cpu6502 *cpu, uint8_t offset){
+  if (cpu->P.C == 1) cpu->PC += (int8_t)offset;
+  return cpu->P.C == 1;
 }
 
 #define BEQ(offset) BEQ_c(&default_cpu, offset)
-void BEQ_c(cpu6502 *cpu, uint8_t offset){
-  if (cpu->P.Z == 1) cpu->PC += offset;
+int BEQ_c(cpu6502 *cpu, uint8_t offset){
+  if (cpu->P.Z == 1) cpu->PC += (int8_t)offset;
+  return cpu->P.Z == 1;
 }
 
 #define BIT(M) BIT_c(&default_cpu, M)
@@ -121,18 +338,33 @@ void BIT_c(cpu6502 *cpu, uint8_t M){
 }
 
 #define BMI(offset) BMI_c(&default_cpu, offset)
-void BMI_c(cpu6502 *cpu, uint8_t offset){
-  if (cpu->P.N == 1) cpu->PC += offset;
+int BMI_c(cpu6502 *cpu, uint8_t offset){
+  if (cpu->P.N == 1) cpu->PC += (int8_t)offset;
+  return cpu->P.N == 1;
 }
 
 #define BNE(offset) BNE_c(&default_cpu, offset)
-void BNE_c(cpu6502 *cpu, uint8_t offset){
-  if (!cpu->P.Z) cpu->PC += offset;
+int BNE_c(cpu6502 *cpu, uint8_t offset){
+  if (!cpu->P.Z) cpu->PC += (int8_t)offset;
+  return !cpu->P.Z;
 }
 
 #define BPL(offset) BPL_c(&default_cpu, offset)
-void BPL_c(cpu6502 *cpu, uint8_t offset){
-  if (!cpu->P.N) cpu->PC += offset;
+int BPL_c(cpu6502 *cpu, uint8_t offset){
+  if (!cpu->P.N) cpu->PC += (int8_t)offset;
+  return !cpu->P.N;
+}
+
+#define BVC(offset) BVC_c(&default_cpu, offset)
+int BVC_c(cpu6502 *cpu, uint8_t offset){
+  if (!cpu->P.V) cpu->PC += (int8_t)offset;
+  return !cpu->P.V;
+}
+
+#define BVS(offset) BVS_c(&default_cpu, offset)
+int BVS_c(cpu6502 *cpu, uint8_t offset){
+  if (cpu->P.V == 1) cpu->PC += (int8_t)offset;
+  return cpu->P.V == 1;
 }
 
 #define CLC() CLC_c(&default_cpu)
@@ -145,9 +377,15 @@ void CLD_c(cpu6502 *cpu){
   cpu->P.D = 0;
 }
 
+static inline void check_irq_unmasked_c(cpu6502 *cpu){
+  if (__builtin_expect(irq_waiting, 0) && !cpu->P.I && cpu->stop == STOP_NONE)
+    cpu->stop = STOP_IO;
+}
+
 #define CLI() CLI_c(&default_cpu)
 void CLI_c(cpu6502 *cpu){
   cpu->P.I = 0;
+  check_irq_unmasked_c(cpu);
 }
 
 #define CLV() CLV_c(&default_cpu)
@@ -185,10 +423,10 @@ void CPY_c(cpu6502 *cpu, uint8_t M){
 #define DEC(addr) DEC_c(&default_cpu, addr)
 void DEC_c(cpu6502 *cpu, uint16_t addr){
   // Z N affected
-  uint8_t value = memory[addr];
+  uint8_t value = read_mem_c(cpu, addr);
   value = (value - 1) & U8_MAX;
 
-  memory[addr] = value;
+  write_mem_c(cpu, addr, value);
   cpu->P.Z = (value == 0);
   cpu->P.N = (value & 0x80) != 0;
 }
@@ -226,10 +464,10 @@ void EOR_c(cpu6502 *cpu, uint8_t M){
 #define INC(addr) INC_c(&default_cpu, addr)
 void INC_c(cpu6502 *cpu, uint16_t addr){
   // Z N affected
-  uint8_t value = memory[addr];
+  uint8_t value = read_mem_c(cpu, addr);
   value = (value + 1) & U8_MAX;
 
-  memory[addr] = value;
+  write_mem_c(cpu, addr, value);
   cpu->P.Z = (value == 0);
   cpu->P.N = (value & 0x80) != 0;
 }
@@ -261,6 +499,15 @@ void JMP_c(cpu6502 *cpu, uint16_t addr){
   cpu->PC = addr;
 }
 
+#define JSR(addr) JSR_c(&default_cpu, addr)
+void JSR_c(cpu6502 *cpu, uint16_t addr){
+  // pushes the address of the last byte of the JSR instruction
+  uint16_t ret = cpu->PC - 1;
+  push_c(cpu, ret >> 8);
+  push_c(cpu, ret & U8_MAX);
+  cpu->PC = addr;
+}
+
 #define LDA(M) LDA_c(&default_cpu, M)
 void LDA_c(cpu6502 *cpu, uint8_t M){
   // Z N affected
@@ -285,6 +532,32 @@ void LDY_c(cpu6502 *cpu, uint8_t M){
   cpu->P.N = (cpu->Y & 0x80) != 0;
 }
 
+#define LSR(addr) LSR_c(&default_cpu, addr)
+void LSR_c(cpu6502 *cpu, uint16_t addr){
+  // C Z N affected
+  uint8_t value = read_mem_c(cpu, addr);
+  cpu->P.C = value & 0x01;
+  value = value >> 1;
+
+  write_mem_c(cpu, addr, value);
+  cpu->P.Z = (value == 0);
+  cpu->P.N = 0;
+}
+
+#define LSR_A() LSR_A_c(&default_cpu)
+void LSR_A_c(cpu6502 *cpu){
+  // C Z N affected
+  cpu->P.C = cpu->A & 0x01;
+  cpu->A = cpu->A >> 1;
+  cpu->P.Z = (cpu->A == 0);
+  cpu->P.N = 0;
+}
+
+#define NOP() NOP_c(&default_cpu)
+void NOP_c(cpu6502 *cpu){
+  (void)cpu;
+}
+
 #define ORA(M) ORA_c(&default_cpu, M)
 void ORA_c(cpu6502 *cpu, uint8_t M){
   // Z N affected
@@ -300,7 +573,8 @@ void PHA_c(cpu6502 *cpu){
 
 #define PHP() PHP_c(&default_cpu)
 void PHP_c(cpu6502 *cpu){
-  // push(cpu, cpu->P); not sure how to do for now
+  // B and U are always set in the pushed copy
+  push_c(cpu, status_to_byte_c(cpu->P) | 0x30);
 }
 
 #define PLA() PLA_c(&default_cpu)
@@ -308,7 +582,109 @@ uint8_t PLA_c(cpu6502 *cpu){
   return pull_c(cpu);
 }
 
-// TODO: IMPLEMENT PLP
+#define PLP() PLP_c(&default_cpu)
+void PLP_c(cpu6502 *cpu){
+  status_from_byte_c(&cpu->P, pull_c(cpu));
+  check_irq_unmasked_c(cpu);
+}
+
+#define ROL(addr) ROL_c(&default_cpu, addr)
+void ROL_c(cpu6502 *cpu, uint16_t addr){
+  // C Z N affected
+  uint8_t value = read_mem_c(cpu, addr);
+  uint8_t carry = cpu->P.C;
+  cpu->P.C = (value & 0x80) != 0;
+  value = ((value << 1) | carry) & U8_MAX;
+
+  write_mem_c(cpu, addr, value);
+  cpu->P.Z = (value == 0);
+  cpu->P.N = (value & 0x80) != 0;
+}
+
+#define ROL_A() ROL_A_c(&default_cpu)
+void ROL_A_c(cpu6502 *cpu){
+  // C Z N affected
+  uint8_t carry = cpu->P.C;
+  cpu->P.C = (cpu->A & 0x80) != 0;
+  cpu->A = ((cpu->A << 1) | carry) & U8_MAX;
+  cpu->P.Z = (cpu->A == 0);
+  cpu->P.N = (cpu->A & 0x80) != 0;
+}
+
+#define ROR(addr) ROR_c(&default_cpu, addr)
+void ROR_c(cpu6502 *cpu, uint16_t addr){
+  // C Z N affected
+  uint8_t value = read_mem_c(cpu, addr);
+  uint8_t carry = cpu->P.C;
+  cpu->P.C = value & 0x01;
+  value = (value >> 1) | (carry << 7);
+
+  write_mem_c(cpu, addr, value);
+  cpu->P.Z = (value == 0);
+  cpu->P.N = (value & 0x80) != 0;
+}
+
+#define ROR_A() ROR_A_c(&default_cpu)
+void ROR_A_c(cpu6502 *cpu){
+  // C Z N affected
+  uint8_t carry = cpu->P.C;
+  cpu->P.C = cpu->A & 0x01;
+  cpu->A = (cpu->A >> 1) | (carry << 7);
+  cpu->P.Z = (cpu->A == 0);
+  cpu->P.N = (cpu->A & 0x80) != 0;
+}
+
+#define RTI() RTI_c(&default_cpu)
+void RTI_c(cpu6502 *cpu){
+  status_from_byte_c(&cpu->P, pull_c(cpu));
+  uint8_t lo = pull_c(cpu);
+  uint8_t hi = pull_c(cpu);
+  cpu->PC = (hi << 8) | lo;
+  check_irq_unmasked_c(cpu);
+}
+
+// Takes an interrupt request unless I masks it: pushes PC and P with B
+// clear, sets I and continues at the vector in $FFFE. Returns whether the
+// interrupt was taken.
+#define irq() irq_c(&default_cpu)
+int irq_c(cpu6502 *cpu){
+  if (cpu->P.I) return 0;
+  push_c(cpu, cpu->PC >> 8);
+  push_c(cpu, cpu->PC & U8_MAX);
+  push_c(cpu, (status_to_byte_c(cpu->P) & ~0x10) | 0x20);
+  cpu->P.I = 1;
+  cpu->PC = read_mem_c(cpu, 0xFFFE) | (read_mem_c(cpu, 0xFFFF) << 8);
+  cpu->cycles += 7;
+  return 1;
+}
+
+#define RTS() RTS_c(&default_cpu)
+void RTS_c(cpu6502 *cpu){
+  uint8_t lo = pull_c(cpu);
+  uint8_t hi = pull_c(cpu);
+  cpu->PC = ((hi << 8) | lo) + 1;
+}
+
+#define SBC(M) SBC_c(&default_cpu, M)
+void SBC_c(cpu6502 *cpu, uint8_t M){
+  // C Z V N affected, flags always come from the binary difference
+  uint8_t borrow = cpu->P.C ? 0 : 1;
+  int diff = cpu->A - M - borrow;
+
+  cpu->P.C = (diff >= 0);
+  cpu->P.V = ((cpu->A ^ M) & (cpu->A ^ diff) & 0x80) != 0;
+  cpu->P.Z = ((diff & U8_MAX) == 0);
+  cpu->P.N = (diff & 0x80) != 0;
+
+  if (cpu->P.D) {
+    int lo = (cpu->A & 0x0F) - (M & 0x0F) - borrow;
+    int hi = (cpu->A & 0xF0) - (M & 0xF0);
+    if (lo & 0x10) { lo -= 0x06; hi -= 0x10; }
+    if (hi & 0x100) hi -= 0x60;
+    diff = (hi & 0xF0) | (lo & 0x0F);
+  }
+  cpu->A = diff & U8_MAX;
+}
 
 #define SEC() SEC_c(&default_cpu)
 void SEC_c(cpu6502 *cpu){
@@ -327,17 +703,17 @@ void SEI_c(cpu6502 *cpu){
 
 #define STA(addr) STA_c(&default_cpu, addr)
 void STA_c(cpu6502 *cpu, uint16_t addr){
-  memory[addr] = cpu->A;
+  write_mem_c(cpu, addr, cpu->A);
 }
 
 #define STX(addr) STX_c(&default_cpu, addr)
 void STX_c(cpu6502 *cpu, uint16_t addr){
-  memory[addr] = cpu->X;
+  write_mem_c(cpu, addr, cpu->X);
 }
 
 #define STY(addr) STY_c(&default_cpu, addr)
 void STY_c(cpu6502 *cpu, uint16_t addr){
-  memory[addr] = cpu->Y;
+  write_mem_c(cpu, addr, cpu->Y);
 }
 
 #define TAX() TAX_c(&default_cpu)
@@ -385,3 +761,321 @@ void TYA_c(cpu6502 *cpu){
   cpu->P.N = (cpu->A & 0x80) != 0;
 }
 
+
+// Instruction decoding. Every documented NMOS opcode maps to an operation,
+// an addressing mode and its base cycle count; undocumented opcodes stop
+// the CPU with STOP_ILLEGAL.
+typedef enum {
+  OP_ADC, OP_AND, OP_ASL, OP_BCC, OP_BCS, OP_BEQ, OP_BIT, OP_BMI, OP_BNE,
+  OP_BPL, OP_BRK, OP_BVC, OP_BVS, OP_CLC, OP_CLD, OP_CLI, OP_CLV, OP_CMP,
+  OP_CPX, OP_CPY, OP_DEC, OP_DEX, OP_DEY, OP_EOR, OP_INC, OP_INX, OP_INY,
+  OP_JMP, OP_JSR, OP_LDA, OP_LDX, OP_LDY, OP_LSR, OP_NOP, OP_ORA, OP_PHA,
+  OP_PHP, OP_PLA, OP_PLP, OP_ROL, OP_ROR, OP_RTI, OP_RTS, OP_SBC, OP_SEC,
+  OP_SED, OP_SEI, OP_STA, OP_STX, OP_STY, OP_TAX, OP_TAY, OP_TSX, OP_TXA,
+  OP_TXS, OP_TYA
+} op_t;
+
+typedef enum {
+  MODE_IMP, MODE_ACC, MODE_IMM, MODE_ZP, MODE_ZPX, MODE_ZPY, MODE_ABS,
+  MODE_ABX, MODE_ABY, MODE_IND, MODE_IZX, MODE_IZY, MODE_REL
+} addr_mode;
+
+typedef struct {
+  uint8_t op;     // op_t
+  uint8_t mode;   // addr_mode
+  uint8_t cycles; // base cycles, 0 if the opcode is not implemented
+} opcode_info;
+
+// X(opcode, operation, addressing mode, base cycles)
+#define OPCODES(X) \
+  X(0x69, ADC, IMM, 2) X(0x65, ADC, ZP , 3) X(0x75, ADC, ZPX, 4) \
+  X(0x6D, ADC, ABS, 4) X(0x7D, ADC, ABX, 4) X(0x79, ADC, ABY, 4) \
+  X(0x61, ADC, IZX, 6) X(0x71, ADC, IZY, 5) \
+  X(0x29, AND, IMM, 2) X(0x25, AND, ZP , 3) X(0x35, AND, ZPX, 4) \
+  X(0x2D, AND, ABS, 4) X(0x3D, AND, ABX, 4) X(0x39, AND, ABY, 4) \
+  X(0x21, AND, IZX, 6) X(0x31, AND, IZY, 5) \
+  X(0x0A, ASL, ACC, 2) X(0x06, ASL, ZP , 5) X(0x16, ASL, ZPX, 6) \
+  X(0x0E, ASL, ABS, 6) X(0x1E, ASL, ABX, 7) \
+  X(0x90, BCC, REL, 2) \
+  X(0xB0, BCS, REL, 2) \
+  X(0xF0, BEQ, REL, 2) \
+  X(0x30, BMI, REL, 2) \
+  X(0xD0, BNE, REL, 2) \
+  X(0x10, BPL, REL, 2) \
+  X(0x50, BVC, REL, 2) \
+  X(0x70, BVS, REL, 2) \
+  X(0x24, BIT, ZP , 3) X(0x2C, BIT, ABS, 4) \
+  X(0x00, BRK, IMP, 7) \
+  X(0x18, CLC, IMP, 2) \
+  X(0xD8, CLD, IMP, 2) \
+  X(0x58, CLI, IMP, 2) \
+  X(0xB8, CLV, IMP, 2) \
+  X(0xC9, CMP, IMM, 2) X(0xC5, CMP, ZP , 3) X(0xD5, CMP, ZPX, 4) \
+  X(0xCD, CMP, ABS, 4) X(0xDD, CMP, ABX, 4) X(0xD9, CMP, ABY, 4) \
+  X(0xC1, CMP, IZX, 6) X(0xD1, CMP, IZY, 5) \
+  X(0xE0, CPX, IMM, 2) X(0xE4, CPX, ZP , 3) X(0xEC, CPX, ABS, 4) \
+  X(0xC0, CPY, IMM, 2) X(0xC4, CPY, ZP , 3) X(0xCC, CPY, ABS, 4) \
+  X(0xC6, DEC, ZP , 5) X(0xD6, DEC, ZPX, 6) X(0xCE, DEC, ABS, 6) \
+  X(0xDE, DEC, ABX, 7) \
+  X(0xCA, DEX, IMP, 2) \
+  X(0x88, DEY, IMP, 2) \
+  X(0x49, EOR, IMM, 2) X(0x45, EOR, ZP , 3) X(0x55, EOR, ZPX, 4) \
+  X(0x4D, EOR, ABS, 4) X(0x5D, EOR, ABX, 4) X(0x59, EOR, ABY, 4) \
+  X(0x41, EOR, IZX, 6) X(0x51, EOR, IZY, 5) \
+  X(0xE6, INC, ZP , 5) X(0xF6, INC, ZPX, 6) X(0xEE, INC, ABS, 6) \
+  X(0xFE, INC, ABX, 7) \
+  X(0xE8, INX, IMP, 2) \
+  X(0xC8, INY, IMP, 2) \
+  X(0x4C, JMP, ABS, 3) X(0x6C, JMP, IND, 5) \
+  X(0x20, JSR, ABS, 6) \
+  X(0xA9, LDA, IMM, 2) X(0xA5, LDA, ZP , 3) X(0xB5, LDA, ZPX, 4) \
+  X(0xAD, LDA, ABS, 4) X(0xBD, LDA, ABX, 4) X(0xB9, LDA, ABY, 4) \
+  X(0xA1, LDA, IZX, 6) X(0xB1, LDA, IZY, 5) \
+  X(0xA2, LDX, IMM, 2) X(0xA6, LDX, ZP , 3) X(0xB6, LDX, ZPY, 4) \
+  X(0xAE, LDX, ABS, 4) X(0xBE, LDX, ABY, 4) \
+  X(0xA0, LDY, IMM, 2) X(0xA4, LDY, ZP , 3) X(0xB4, LDY, ZPX, 4) \
+  X(0xAC, LDY, ABS, 4) X(0xBC, LDY, ABX, 4) \
+  X(0x4A, LSR, ACC, 2) X(0x46, LSR, ZP , 5) X(0x56, LSR, ZPX, 6) \
+  X(0x4E, LSR, ABS, 6) X(0x5E, LSR, ABX, 7) \
+  X(0xEA, NOP, IMP, 2) \
+  X(0x09, ORA, IMM, 2) X(0x05, ORA, ZP , 3) X(0x15, ORA, ZPX, 4) \
+  X(0x0D, ORA, ABS, 4) X(0x1D, ORA, ABX, 4) X(0x19, ORA, ABY, 4) \
+  X(0x01, ORA, IZX, 6) X(0x11, ORA, IZY, 5) \
+  X(0x48, PHA, IMP, 3) \
+  X(0x08, PHP, IMP, 3) \
+  X(0x68, PLA, IMP, 4) \
+  X(0x28, PLP, IMP, 4) \
+  X(0x2A, ROL, ACC, 2) X(0x26, ROL, ZP , 5) X(0x36, ROL, ZPX, 6) \
+  X(0x2E, ROL, ABS, 6) X(0x3E, ROL, ABX, 7) \
+  X(0x6A, ROR, ACC, 2) X(0x66, ROR, ZP , 5) X(0x76, ROR, ZPX, 6) \
+  X(0x6E, ROR, ABS, 6) X(0x7E, ROR, ABX, 7) \
+  X(0x40, RTI, IMP, 6) \
+  X(0x60, RTS, IMP, 6) \
+  X(0xE9, SBC, IMM, 2) X(0xE5, SBC, ZP , 3) X(0xF5, SBC, ZPX, 4) \
+  X(0xED, SBC, ABS, 4) X(0xFD, SBC, ABX, 4) X(0xF9, SBC, ABY, 4) \
+  X(0xE1, SBC, IZX, 6) X(0xF1, SBC, IZY, 5) \
+  X(0x38, SEC, IMP, 2) \
+  X(0xF8, SED, IMP, 2) \
+  X(0x78, SEI, IMP, 2) \
+  X(0x85, STA, ZP , 3) X(0x95, STA, ZPX, 4) X(0x8D, STA, ABS, 4) \
+  X(0x9D, STA, ABX, 5) X(0x99, STA, ABY, 5) X(0x81, STA, IZX, 6) \
+  X(0x91, STA, IZY, 6) \
+  X(0x86, STX, ZP , 3) X(0x96, STX, ZPY, 4) X(0x8E, STX, ABS, 4) \
+  X(0x84, STY, ZP , 3) X(0x94, STY, ZPX, 4) X(0x8C, STY, ABS, 4) \
+  X(0xAA, TAX, IMP, 2) \
+  X(0xA8, TAY, IMP, 2) \
+  X(0xBA, TSX, IMP, 2) \
+  X(0x8A, TXA, IMP, 2) \
+  X(0x9A, TXS, IMP, 2) \
+  X(0x98, TYA, IMP, 2) \
+
+static const opcode_info opcode_table[0x100] = {
+#define X(code, op, mode, cycles) [code] = {OP_##op, MODE_##mode, cycles},
+  OPCODES(X)
+#undef X
+};
+
+// Operand bytes are instruction fetches, not data reads, so they don't
+// trigger read watchpoints and go straight through read_pages.
+static inline uint8_t fetch_mem(uint16_t addr){
+  return read_pages[addr >> 8][addr & U8_MAX];
+}
+
+static inline uint16_t fetch_abs(cpu6502 *cpu){
+  uint16_t addr = fetch_mem(cpu->PC) | (fetch_mem(cpu->PC + 1) << 8);
+  cpu->PC += 2;
+  return addr;
+}
+
+static inline uint16_t read_mem16_zp(cpu6502 *cpu, uint8_t zp){
+  return read_mem_c(cpu, zp) | (read_mem_c(cpu, (zp + 1) & U8_MAX) << 8);
+}
+
+// Building with CPU_FAST drops the cycles that depend on the data (page
+// crossings and taken branches) and keeps only each opcode's base cost.
+#ifdef CPU_FAST
+#define PAGE_PENALTY(crossed) ((void)0)
+#define BRANCH(name) name##_c(cpu, fetch_mem(addr))
+#else
+#define PAGE_PENALTY(crossed) (cpu->cycles += (crossed))
+#define BRANCH(name) do {                                               \
+    uint16_t from = cpu->PC;                                            \
+    /* taken branches cost one cycle, two if they land on another page */ \
+    if (name##_c(cpu, fetch_mem(addr)))                                 \
+      cpu->cycles += 1 + (((from ^ cpu->PC) & 0xFF00) != 0);            \
+  } while (0)
+#endif
+
+// Addressing modes: each declares the effective address and whether
+// indexing crossed a page.
+#define ADDR_IMP uint16_t addr = 0; uint8_t crossed = 0;
+#define ADDR_ACC ADDR_IMP
+#define ADDR_IMM uint16_t addr = cpu->PC++; uint8_t crossed = 0;
+#define ADDR_REL ADDR_IMM
+#define ADDR_ZP  uint16_t addr = fetch_mem(cpu->PC++); uint8_t crossed = 0;
+#define ADDR_ZPX uint16_t addr = (fetch_mem(cpu->PC++) + cpu->X) & U8_MAX; uint8_t crossed = 0;
+#define ADDR_ZPY uint16_t addr = (fetch_mem(cpu->PC++) + cpu->Y) & U8_MAX; uint8_t crossed = 0;
+#define ADDR_ABS uint16_t addr = fetch_abs(cpu); uint8_t crossed = 0;
+#define ADDR_ABX uint16_t base = fetch_abs(cpu), addr = base + cpu->X; \
+                 uint8_t crossed = ((base ^ addr) & 0xFF00) != 0;
+#define ADDR_ABY uint16_t base = fetch_abs(cpu), addr = base + cpu->Y; \
+                 uint8_t crossed = ((base ^ addr) & 0xFF00) != 0;
+// NMOS bug: the pointer's high byte never carries into the next page
+#define ADDR_IND uint16_t base = fetch_abs(cpu);                                  \
+                 uint16_t addr = read_mem_c(cpu, base) |                         \
+                   (read_mem_c(cpu, (base & 0xFF00) | ((base + 1) & U8_MAX)) << 8); \
+                 uint8_t crossed = 0;
+#define ADDR_IZX uint16_t addr = read_mem16_zp(cpu, fetch_mem(cpu->PC++) + cpu->X); \
+                 uint8_t crossed = 0;
+#define ADDR_IZY uint16_t base = read_mem16_zp(cpu, fetch_mem(cpu->PC++));        \
+                 uint16_t addr = base + cpu->Y;                                  \
+                 uint8_t crossed = ((base ^ addr) & 0xFF00) != 0;
+
+// Operand of a read instruction; only these pay for crossing a page.
+#define OPERAND_IMM fetch_mem(addr)
+#define OPERAND_ZP  read_mem_c(cpu, addr)
+#define OPERAND_ZPX read_mem_c(cpu, addr)
+#define OPERAND_ZPY read_mem_c(cpu, addr)
+#define OPERAND_ABS read_mem_c(cpu, addr)
+#define OPERAND_ABX (PAGE_PENALTY(crossed), read_mem_c(cpu, addr))
+#define OPERAND_ABY (PAGE_PENALTY(crossed), read_mem_c(cpu, addr))
+#define OPERAND_IZX read_mem_c(cpu, addr)
+#define OPERAND_IZY (PAGE_PENALTY(crossed), read_mem_c(cpu, addr))
+
+// Shifts and rotates work on A or on memory.
+#define SHIFT_ACC(name) name##_A_c(cpu)
+#define SHIFT_ZP(name)  name##_c(cpu, addr)
+#define SHIFT_ZPX(name) name##_c(cpu, addr)
+#define SHIFT_ABS(name) name##_c(cpu, addr)
+#define SHIFT_ABX(name) name##_c(cpu, addr)
+
+// Operations, in terms of the _c functions above.
+#define EXEC_ADC(mode) ADC_c(cpu, OPERAND_##mode)
+#define EXEC_AND(mode) AND_c(cpu, OPERAND_##mode)
+#define EXEC_ASL(mode) SHIFT_##mode(ASL)
+#define EXEC_BCC(mode) BRANCH(BCC)
+#define EXEC_BCS(mode) BRANCH(BCS)
+#define EXEC_BEQ(mode) BRANCH(BEQ)
+#define EXEC_BIT(mode) BIT_c(cpu, OPERAND_##mode)
+#define EXEC_BMI(mode) BRANCH(BMI)
+#define EXEC_BNE(mode) BRANCH(BNE)
+#define EXEC_BPL(mode) BRANCH(BPL)
+#define EXEC_BRK(mode) (cpu->PC++, BRK_c(cpu), cpu->stop = STOP_BRK)
+#define EXEC_BVC(mode) BRANCH(BVC)
+#define EXEC_BVS(mode) BRANCH(BVS)
+#define EXEC_CLC(mode) CLC_c(cpu)
+#define EXEC_CLD(mode) CLD_c(cpu)
+#define EXEC_CLI(mode) CLI_c(cpu)
+#define EXEC_CLV(mode) CLV_c(cpu)
+#define EXEC_CMP(mode) CMP_c(cpu, OPERAND_##mode)
+#define EXEC_CPX(mode) CPX_c(cpu, OPERAND_##mode)
+#define EXEC_CPY(mode) CPY_c(cpu, OPERAND_##mode)
+#define EXEC_DEC(mode) DEC_c(cpu, addr)
+#define EXEC_DEX(mode) DEX_c(cpu)
+#define EXEC_DEY(mode) DEY_c(cpu)
+#define EXEC_EOR(mode) EOR_c(cpu, OPERAND_##mode)
+#define EXEC_INC(mode) INC_c(cpu, addr)
+#define EXEC_INX(mode) INX_c(cpu)
+#define EXEC_INY(mode) INY_c(cpu)
+#define EXEC_JMP(mode) JMP_c(cpu, addr)
+#define EXEC_JSR(mode) JSR_c(cpu, addr)
+#define EXEC_LDA(mode) LDA_c(cpu, OPERAND_##mode)
+#define EXEC_LDX(mode) LDX_c(cpu, OPERAND_##mode)
+#define EXEC_LDY(mode) LDY_c(cpu, OPERAND_##mode)
+#define EXEC_LSR(mode) SHIFT_##mode(LSR)
+#define EXEC_NOP(mode) NOP_c(cpu)
+#define EXEC_ORA(mode) ORA_c(cpu, OPERAND_##mode)
+#define EXEC_PHA(mode) PHA_c(cpu)
+#define EXEC_PHP(mode) PHP_c(cpu)
+#define EXEC_PLA(mode) LDA_c(cpu, PLA_c(cpu))
+#define EXEC_PLP(mode) PLP_c(cpu)
+#define EXEC_ROL(mode) SHIFT_##mode(ROL)
+#define EXEC_ROR(mode) SHIFT_##mode(ROR)
+#define EXEC_RTI(mode) RTI_c(cpu)
+#define EXEC_RTS(mode) RTS_c(cpu)
+#define EXEC_SBC(mode) SBC_c(cpu, OPERAND_##mode)
+#define EXEC_SEC(mode) SEC_c(cpu)
+#define EXEC_SED(mode) SED_c(cpu)
+#define EXEC_SEI(mode) SEI_c(cpu)
+#define EXEC_STA(mode) STA_c(cpu, addr)
+#define EXEC_STX(mode) STX_c(cpu, addr)
+#define EXEC_STY(mode) STY_c(cpu, addr)
+#define EXEC_TAX(mode) TAX_c(cpu)
+#define EXEC_TAY(mode) TAY_c(cpu)
+#define EXEC_TSX(mode) TSX_c(cpu)
+#define EXEC_TXA(mode) TXA_c(cpu)
+#define EXEC_TXS(mode) TXS_c(cpu)
+#define EXEC_TYA(mode) TYA_c(cpu)
+
+// One handler per opcode with its addressing mode, operation and cycle
+// cost fused at compile time. Called with PC just past the opcode byte.
+#define X(code, op, mode, cost)                     \
+  static inline __attribute__((always_inline))      \
+  void exec_##code(cpu6502 *cpu){                   \
+    ADDR_##mode                                     \
+    (void)addr;                                     \
+    (void)crossed;                                  \
+    cpu->cycles += cost;                            \
+    EXEC_##op(mode);                                \
+  }
+OPCODES(X)
+#undef X
+
+// Executes one instruction. BRK does not vector through $FFFE yet, it stops
+// the CPU with the PC just past its padding byte.
+#define step() step_c(&default_cpu)
+void step_c(cpu6502 *cpu){
+  switch (fetch_mem(cpu->PC)) {
+#define X(code, op, mode, cost) case code: cpu->PC++; exec_##code(cpu); break;
+    OPCODES(X)
+#undef X
+    default:
+      cpu->stop = STOP_ILLEGAL;
+      break;
+  }
+}
+
+// The run loop is built twice: run_c() only takes the variant that tests
+// break_map before every instruction while at least one breakpoint is set.
+// Both work on a local copy of the registers and are flattened, so every
+// handler is inlined into one dispatch switch and the registers can stay
+// in host registers until the loop exits.
+static inline __attribute__((always_inline))
+uint64_t run_loop(cpu6502 *out, uint64_t max, const int check_breaks){
+  cpu6502 regs = *out, *cpu = &regs;
+  uint64_t n = 0;
+  cpu->stop = STOP_NONE;
+  while (n < max) {
+    // a breakpoint on the first instruction is stepped over so runs resume
+    if (check_breaks && n > 0 && MAP_TEST(break_map, cpu->PC)) {
+      cpu->stop = STOP_BREAKPOINT;
+      break;
+    }
+    step_c(cpu);
+    if (__builtin_expect(cpu->stop != STOP_NONE, 0)) {
+      if (cpu->stop != STOP_ILLEGAL) n++;
+      break;
+    }
+    n++;
+  }
+  *out = regs;
+  return n;
+}
+
+static __attribute__((flatten)) uint64_t run_plain(cpu6502 *cpu, uint64_t max){
+  return run_loop(cpu, max, 0);
+}
+
+static __attribute__((flatten)) uint64_t run_checked(cpu6502 *cpu, uint64_t max){
+  return run_loop(cpu, max, 1);
+}
+
+// Runs at most max instructions and returns how many executed; cpu->stop
+// tells why it returned early.
+#define run(max) run_c(&default_cpu, max)
+uint64_t run_c(cpu6502 *cpu, uint64_t max){
+  if (break_count) return run_checked(cpu, max);
+  return run_plain(cpu, max);
+}
+
+#endif // CPU_C
@@ -0,0 +1,353 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.c"
+
+// Memory-mapped peripherals that run on their own threads. Each attached
+// device gets a window of registers and a thread that owns its state; the
+// CPU thread never calls into a device directly. The two sides talk through
+// a pair of single-producer single-consumer queues per device:
+//
+//   CPU -> device  register writes, register reads and time markers, each
+//                  stamped with the CPU cycle it happens on
+//   device -> CPU  read results and interrupt requests
+//
+// Writes are posted and the CPU carries on. Only a register read makes the
+// CPU wait, for the device to work through everything before it and answer
+// as of that cycle, so what the program sees is cycle-consistent no matter
+// how far behind the device thread is. Between reads the CPU runs ahead in
+// slices and, after each one, waits only if a device has fallen more than
+// device_lag_window cycles behind.
+//
+// Interrupt requests are events stamped with the cycle they are due on;
+// each one is taken once, at the first instruction boundary at or after
+// that cycle where I is clear. For that to come out the same on every run
+// a device that raises them sets irqs and promises irq_lead: no request is
+// due sooner than that many cycles after the message that raised it, so a
+// timer asks for its interrupt when it is started, not when it runs out.
+// The CPU can then run ahead of a device by up to irq_lead cycles knowing
+// it has every request that could fall due in between, and only waits for
+// the device where it would otherwise go further. Devices must not touch
+// memory, which belongs to the CPU thread.
+
+#define DEVICES_MAX       8
+#define DEVICE_QUEUE_SIZE 1024 // messages, must be a power of two
+#define DEVICE_LAG_CYCLES 20000
+#define DEVICE_IRQS_MAX   64   // outstanding interrupt requests
+
+typedef enum {
+  MSG_WRITE,  // to the device: value written to reg
+  MSG_READ,   // to the device: read reg, answer with MSG_VALUE
+  MSG_TIME,   // to the device: the CPU has reached cycle
+  MSG_QUIT,   // to the device: stop the thread
+  MSG_VALUE,  // to the CPU: result of the last MSG_READ
+  MSG_IRQ,    // to the CPU: interrupt request
+} device_msg_kind;
+
+typedef struct {
+  uint64_t cycle;
+  uint16_t reg;    // offset into the device's window
+  uint8_t value;
+  uint8_t kind;    // device_msg_kind
+} device_msg;
+
+// head and tail only ever grow; each sits on its own cache line so the
+// producer and the consumer don't fight over one.
+typedef struct {
+  _Alignas(64) atomic_size_t head; // next message to pop, written by the consumer
+  _Alignas(64) atomic_size_t tail; // next free slot, written by the producer
+  _Alignas(64) device_msg slots[DEVICE_QUEUE_SIZE];
+} spsc_queue;
+
+static int queue_push(spsc_queue *q, device_msg msg) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == DEVICE_QUEUE_SIZE)
+    return 0;
+  q->slots[tail & (DEVICE_QUEUE_SIZE - 1)] = msg;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+static int queue_pop(spsc_queue *q, device_msg *msg) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) return 0;
+  *msg = q->slots[head & (DEVICE_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return 1;
+}
+
+typedef struct device device;
+
+// The callbacks run on the device's own thread, in cycle order. Any of them
+// may be NULL; reads of a device without read() return $FF.
+struct device {
+  const char *name;
+  // catch up with the CPU: everything up to cycle has happened
+  void (*advance)(device *dev, uint64_t cycle);
+  void (*write)(device *dev, uint16_t reg, uint8_t value, uint64_t cycle);
+  uint8_t (*read)(device *dev, uint16_t reg, uint64_t cycle);
+  void *data;
+  int irqs;          // set if the callbacks call device_irq()
+  uint64_t irq_lead; // with irqs: requests are due at least this long after
+                     // the message that raised them
+
+  // set by attach_device
+  uint16_t base;
+  uint16_t size;
+  spsc_queue to_device;
+  spsc_queue to_cpu;
+  pthread_t thread;
+  atomic_uint_fast64_t done_cycle; // the device has caught up to here
+  atomic_uint_fast64_t done_count; // messages handled so far
+  uint64_t sent_cycle;             // last cycle the CPU told it about
+  uint64_t sent_count;             // messages sent so far
+  uint64_t handling_cycle;         // device thread only: cycle of the current message
+};
+
+static device *devices[DEVICES_MAX];
+static int device_count = 0;
+// due cycles of the requests not yet taken, earliest first
+static uint64_t pending_irqs[DEVICE_IRQS_MAX];
+static int pending_irq_count = 0;
+static uint64_t device_lag_window = DEVICE_LAG_CYCLES;
+
+// Busy waits yield first and only start sleeping once the other side has
+// been quiet for a while, so round trips stay short while the device is busy
+// without an idle device burning a core.
+static void wait_a_little(unsigned int *spins) {
+  if (++*spins < 1000) {
+    sched_yield();
+  } else {
+    struct timespec ts = {0, 20000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Device side
+
+// Requests an interrupt on cycle; only for use from the callbacks of a
+// device with irqs set. A cycle sooner than irq_lead after the message
+// being handled is moved up to that, as the CPU may already be there.
+void device_irq(device *dev, uint64_t cycle) {
+  device_msg msg = {cycle, 0, 0, MSG_IRQ};
+  if (msg.cycle < dev->handling_cycle + dev->irq_lead)
+    msg.cycle = dev->handling_cycle + dev->irq_lead;
+  unsigned int spins = 0;
+  while (!queue_push(&dev->to_cpu, msg)) wait_a_little(&spins);
+}
+
+static void *device_thread(void *arg) {
+  device *dev = arg;
+  unsigned int spins = 0;
+  for (;;) {
+    device_msg msg;
+    if (!queue_pop(&dev->to_device, &msg)) {
+      wait_a_little(&spins);
+      continue;
+    }
+    spins = 0;
+    if (msg.kind == MSG_QUIT) return NULL;
+
+    dev->handling_cycle = msg.cycle;
+    if (dev->advance) dev->advance(dev, msg.cycle);
+    if (msg.kind == MSG_WRITE && dev->write) {
+      dev->write(dev, msg.reg, msg.value, msg.cycle);
+    } else if (msg.kind == MSG_READ) {
+      device_msg reply = {msg.cycle, msg.reg, 0xFF, MSG_VALUE};
+      if (dev->read) reply.value = dev->read(dev, msg.reg, msg.cycle);
+      while (!queue_push(&dev->to_cpu, reply)) wait_a_little(&spins);
+    }
+    atomic_store_explicit(&dev->done_cycle, msg.cycle, memory_order_release);
+    atomic_fetch_add_explicit(&dev->done_count, 1, memory_order_release);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// CPU side
+
+// Requests beyond DEVICE_IRQS_MAX outstanding ones are dropped.
+static void add_pending_irq(uint64_t cycle) {
+  if (pending_irq_count == DEVICE_IRQS_MAX) return;
+  int i = pending_irq_count++;
+  for (; i > 0 && pending_irqs[i - 1] > cycle; i--) pending_irqs[i] = pending_irqs[i - 1];
+  pending_irqs[i] = cycle;
+}
+
+// Handles everything dev has sent; returns 1 and the value if a read result
+// was among it.
+static int drain_device(device *dev, uint8_t *value) {
+  device_msg msg;
+  int answered = 0;
+  while (queue_pop(&dev->to_cpu, &msg)) {
+    if (msg.kind == MSG_IRQ) {
+      add_pending_irq(msg.cycle);
+    } else if (msg.kind == MSG_VALUE) {
+      *value = msg.value;
+      answered = 1;
+    }
+  }
+  return answered;
+}
+
+static device *device_at(uint16_t addr) {
+  for (int i = 0; i < device_count; i++)
+    if (addr >= devices[i]->base && addr - devices[i]->base < devices[i]->size)
+      return devices[i];
+  return NULL;
+}
+
+static void send_to_device(device *dev, device_msg msg) {
+  unsigned int spins = 0;
+  while (!queue_push(&dev->to_device, msg)) wait_a_little(&spins);
+  dev->sent_cycle = msg.cycle;
+  dev->sent_count++;
+}
+
+static uint8_t device_read(uint16_t addr, uint64_t cycle) {
+  device *dev = device_at(addr);
+  if (!dev) return 0xFF; // unclaimed part of an I/O page
+  send_to_device(dev, (device_msg){cycle, addr - dev->base, 0, MSG_READ});
+  uint8_t value = 0xFF;
+  unsigned int spins = 0;
+  while (!drain_device(dev, &value)) wait_a_little(&spins);
+  return value;
+}
+
+static void device_write(uint16_t addr, uint8_t value, uint64_t cycle) {
+  device *dev = device_at(addr);
+  if (dev) send_to_device(dev, (device_msg){cycle, addr - dev->base, value, MSG_WRITE});
+}
+
+// Tells every device the time, collects interrupt requests and holds the
+// CPU back while a device is more than the lag window behind.
+static void sync_devices(uint64_t cycle) {
+  uint8_t unused;
+  for (int i = 0; i < device_count; i++) {
+    device *dev = devices[i];
+    if (dev->sent_cycle != cycle) send_to_device(dev, (device_msg){cycle, 0, 0, MSG_TIME});
+    unsigned int spins = 0;
+    while (atomic_load_explicit(&dev->done_cycle, memory_order_acquire) +
+           device_lag_window < cycle) {
+      drain_device(dev, &unused);
+      wait_a_little(&spins);
+    }
+    drain_device(dev, &unused);
+  }
+}
+
+// Collects the interrupt requests of the devices that raise them and
+// returns the cycle before which all that can fall due are known: every
+// message a device has still to handle was sent on or after its done_cycle,
+// and every one it will be sent on or after cycle, the CPU's time now.
+static uint64_t irq_horizon(uint64_t cycle) {
+  uint8_t unused;
+  uint64_t horizon = UINT64_MAX;
+  for (int i = 0; i < device_count; i++) {
+    device *dev = devices[i];
+    if (!dev->irqs) continue;
+    uint64_t from = cycle;
+    if (atomic_load_explicit(&dev->done_count, memory_order_acquire) != dev->sent_count)
+      from = atomic_load_explicit(&dev->done_cycle, memory_order_acquire);
+    drain_device(dev, &unused);
+    if (from + dev->irq_lead < horizon) horizon = from + dev->irq_lead;
+  }
+  return horizon;
+}
+
+void set_device_lag(uint64_t cycles) {
+  device_lag_window = cycles;
+}
+
+// Maps dev's registers at base..base+size-1 and starts its thread. The
+// window's pages stop being memory until detach_devices(). Returns 0, or
+// -1 if the window overlaps another device or no slot is left.
+int attach_device(device *dev, uint16_t base, uint16_t size) {
+  if (device_count == DEVICES_MAX || size == 0 || base + size > 0x10000) return -1;
+  for (int i = 0; i < device_count; i++)
+    if (base < devices[i]->base + devices[i]->size && devices[i]->base < base + size)
+      return -1;
+
+  dev->base = base;
+  dev->size = size;
+  atomic_init(&dev->to_device.head, 0);
+  atomic_init(&dev->to_device.tail, 0);
+  atomic_init(&dev->to_cpu.head, 0);
+  atomic_init(&dev->to_cpu.tail, 0);
+  atomic_init(&dev->done_cycle, default_cpu.cycles);
+  atomic_init(&dev->done_count, 0);
+  dev->sent_cycle = default_cpu.cycles;
+  dev->sent_count = 0;
+  dev->handling_cycle = default_cpu.cycles;
+  if (pthread_create(&dev->thread, NULL, device_thread, dev) != 0) return -1;
+
+  io_read = device_read;
+  io_write = device_write;
+  map_io_pages(base >> 8, ((base + size - 1) >> 8) - (base >> 8) + 1);
+  devices[device_count++] = dev;
+  return 0;
+}
+
+// Stops every device thread once it has handled all it was sent, then gives
+// the I/O pages back to memory. Interrupt requests not yet taken are dropped.
+void detach_devices(void) {
+  for (int i = 0; i < device_count; i++) {
+    device *dev = devices[i];
+    send_to_device(dev, (device_msg){dev->sent_cycle, 0, 0, MSG_QUIT});
+    pthread_join(dev->thread, NULL);
+    unmap_io_pages(dev->base >> 8, ((dev->base + dev->size - 1) >> 8) - (dev->base >> 8) + 1);
+  }
+  device_count = 0;
+  pending_irq_count = 0;
+  irq_waiting = 0;
+}
+
+// run_c() with the devices attached: runs at most max instructions,
+// syncing with the devices every half lag window. Runs end early where a
+// device that raises interrupts could still have one due that the CPU
+// doesn't know of, and on the first instruction boundary at or after each
+// known request, which is taken there if I is clear. One that I holds back
+// is taken as soon as CLI, PLP or RTI clears it. Returns the number of
+// instructions executed; cpu->stop says why it returned early.
+#define run_devices(max) run_devices_c(&default_cpu, max)
+uint64_t run_devices_c(cpu6502 *cpu, uint64_t max) {
+  uint64_t slice = device_lag_window / 2 > 0 ? device_lag_window / 2 : 1;
+  uint64_t n = 0, next_sync = cpu->cycles + slice;
+  cpu->stop = STOP_NONE;
+  while (n < max) {
+    // the boundary the CPU is on has to be behind the horizon to be sure
+    // no request is due on it
+    uint64_t horizon;
+    unsigned int spins = 0;
+    while ((horizon = irq_horizon(cpu->cycles)) <= cpu->cycles) wait_a_little(&spins);
+
+    uint64_t until = horizon < next_sync ? horizon : next_sync;
+    irq_waiting = 0;
+    if (pending_irq_count) {
+      uint64_t due = pending_irqs[0];
+      if (due <= cpu->cycles && irq_c(cpu)) {
+        pending_irq_count--;
+        memmove(pending_irqs, pending_irqs + 1, pending_irq_count * sizeof pending_irqs[0]);
+        continue;
+      }
+      if (due <= cpu->cycles) irq_waiting = 1;
+      else if (due < until) until = due;
+    }
+    // at most 8 cycles an instruction: this many certainly end by until
+    uint64_t budget = (until - cpu->cycles) / 8 > 0 ? (until - cpu->cycles) / 8 : 1;
+    n += run_c(cpu, max - n < budget ? max - n : budget);
+    if (cpu->stop == STOP_IO) cpu->stop = STOP_NONE;
+    if (cpu->cycles >= next_sync) {
+      sync_devices(cpu->cycles);
+      next_sync = cpu->cycles + slice;
+    }
+    if (cpu->stop != STOP_NONE) break;
+  }
+  irq_waiting = 0;
+  sync_devices(cpu->cycles);
+  return n;
+}
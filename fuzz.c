@@ -0,0 +1,1021 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "peephole.c"
+
+// Differential tester: runs every operation in cpu.c on generated CPU states
+// and checks the outcome against the reference model below, which is
+// written independently (packed status byte, signed and decimal arithmetic
+// instead of bit tricks, opcodes decoded from their bit patterns instead of
+// opcode_table).
+//
+// Where the input space is small enough it is swept exhaustively, e.g. every
+// A x M x C x D for ADC and SBC or every P x offset for the branches; the
+// rest is randomised from a per-unit seed so failures are reproducible.
+// The work is split into units that are handed out to one thread per core.
+// Units that touch memory hold memory_lock since cpu.c has a single
+// address space; the peephole units assemble outside it and only lock
+// around their runs.
+//
+// The peephole optimizer is checked the same way: random programs are run
+// with and without it and have to end in the same state.
+//
+// Decimal mode is only checked for valid BCD operands, and N and V are not
+// checked after a decimal ADC, as neither is documented for the NMOS part.
+
+#define F_C 0x01
+#define F_Z 0x02
+#define F_I 0x04
+#define F_D 0x08
+#define F_B 0x10
+#define F_U 0x20
+#define F_V 0x40
+#define F_N 0x80
+
+#define DECODER_CASES_PER_UNIT 2000
+#define DECODER_UNITS 100
+#define PEEPHOLE_CASES_PER_UNIT 200
+#define PEEPHOLE_UNITS 50
+#define PEEPHOLE_LENGTH 40
+#define PEEPHOLE_LABELS (PEEPHOLE_LENGTH + 3)
+#define MAX_REPORTS 20
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+typedef struct {
+  uint8_t a, x, y, sp, p;
+  uint16_t pc;
+  uint64_t cycles;
+  uint8_t stop;     // stop_reason
+  uint8_t ignore;   // flags the reference can't predict
+  uint8_t skip;     // inputs outside what the reference models
+} ref_state;
+
+static uint8_t ref_mem[0x10000];
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_ulong cases_run;
+static atomic_ulong failures;
+
+static inline uint64_t rng_next(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t rng_seed(int unit) {
+  uint64_t s = 0x9E3779B97F4A7C15ULL * (unit + 1);
+  return s ? s : 1;
+}
+
+static void report(const char *fmt, ...) {
+  if (atomic_fetch_add(&failures, 1) >= MAX_REPORTS) return;
+  va_list ap;
+  va_start(ap, fmt);
+  pthread_mutex_lock(&report_lock);
+  printf("FAIL ");
+  vprintf(fmt, ap);
+  printf("\n");
+  pthread_mutex_unlock(&report_lock);
+  va_end(ap);
+}
+
+// ------------------------------------------------------------------
+// Reference model
+
+static void set_flag(ref_state *s, uint8_t flag, int on) {
+  s->p = on ? (s->p | flag) : (s->p & ~flag);
+}
+
+static void set_nz(ref_state *s, uint8_t v) {
+  set_flag(s, F_Z, v == 0);
+  set_flag(s, F_N, v >= 0x80);
+}
+
+static int bcd_valid(uint8_t v) { return (v & 0x0F) <= 9 && (v >> 4) <= 9; }
+static int bcd_to_int(uint8_t v) { return (v >> 4) * 10 + (v & 0x0F); }
+static uint8_t int_to_bcd(int v) { return ((v / 10) << 4) | (v % 10); }
+static int as_signed(uint8_t v) { return v < 0x80 ? v : v - 256; }
+
+static void ref_adc(ref_state *s, uint8_t m) {
+  int c = (s->p & F_C) != 0;
+  int bin = s->a + m + c;
+  int sum = as_signed(s->a) + as_signed(m) + c;
+  if (s->p & F_D) {
+    if (!bcd_valid(s->a) || !bcd_valid(m)) { s->skip = 1; return; }
+    int dec = bcd_to_int(s->a) + bcd_to_int(m) + c;
+    set_flag(s, F_C, dec > 99);
+    set_flag(s, F_Z, (bin & 0xFF) == 0);
+    s->a = int_to_bcd(dec % 100);
+    s->ignore |= F_N | F_V;
+    return;
+  }
+  s->a = bin & 0xFF;
+  set_flag(s, F_C, bin > 0xFF);
+  set_flag(s, F_V, sum < -128 || sum > 127);
+  set_nz(s, s->a);
+}
+
+static void ref_sbc(ref_state *s, uint8_t m) {
+  int borrow = (s->p & F_C) == 0;
+  int bin = s->a - m - borrow;
+  int diff = as_signed(s->a) - as_signed(m) - borrow;
+  set_flag(s, F_C, bin >= 0);
+  set_flag(s, F_V, diff < -128 || diff > 127);
+  set_nz(s, bin & 0xFF);
+  if (s->p & F_D) {
+    if (!bcd_valid(s->a) || !bcd_valid(m)) { s->skip = 1; return; }
+    int dec = bcd_to_int(s->a) - bcd_to_int(m) - borrow;
+    s->a = int_to_bcd(dec < 0 ? dec + 100 : dec);
+    return;
+  }
+  s->a = bin & 0xFF;
+}
+
+static void ref_compare(ref_state *s, uint8_t r, uint8_t m) {
+  set_flag(s, F_C, r >= m);
+  set_nz(s, (r - m) & 0xFF);
+}
+
+static void ref_bit(ref_state *s, uint8_t m) {
+  set_flag(s, F_Z, (s->a & m) == 0);
+  set_flag(s, F_N, m & 0x80);
+  set_flag(s, F_V, m & 0x40);
+}
+
+static uint8_t ref_shift(ref_state *s, op_t op, uint8_t v) {
+  int carry_in = (s->p & F_C) != 0;
+  int r;
+  switch (op) {
+    case OP_ASL: r = v * 2; break;
+    case OP_ROL: r = v * 2 + carry_in; break;
+    case OP_LSR: set_flag(s, F_C, v % 2); r = v / 2; set_nz(s, r); return r;
+    default:     set_flag(s, F_C, v % 2); r = v / 2 + carry_in * 128; set_nz(s, r); return r;
+  }
+  set_flag(s, F_C, r > 0xFF);
+  set_nz(s, r & 0xFF);
+  return r & 0xFF;
+}
+
+static void ref_push(ref_state *s, uint8_t v) {
+  ref_mem[0x100 + s->sp] = v;
+  s->sp = (s->sp + 0xFF) & 0xFF;
+}
+
+static uint8_t ref_pull(ref_state *s) {
+  s->sp = (s->sp + 1) & 0xFF;
+  return ref_mem[0x100 + s->sp];
+}
+
+static void ref_set_p(ref_state *s, uint8_t v) {
+  // B and U are not real flags and keep their current values
+  s->p = (v & ~(F_B | F_U)) | (s->p & (F_B | F_U));
+}
+
+static int ref_branch_taken(ref_state *s, op_t op) {
+  switch (op) {
+    case OP_BCC: return !(s->p & F_C);
+    case OP_BCS: return (s->p & F_C) != 0;
+    case OP_BNE: return !(s->p & F_Z);
+    case OP_BEQ: return (s->p & F_Z) != 0;
+    case OP_BPL: return !(s->p & F_N);
+    case OP_BMI: return (s->p & F_N) != 0;
+    case OP_BVC: return !(s->p & F_V);
+    default:     return (s->p & F_V) != 0;
+  }
+}
+
+// Operations that take their operand by value.
+static void ref_value_op(ref_state *s, op_t op, uint8_t m) {
+  switch (op) {
+    case OP_ADC: ref_adc(s, m); break;
+    case OP_SBC: ref_sbc(s, m); break;
+    case OP_AND: s->a &= m; set_nz(s, s->a); break;
+    case OP_ORA: s->a |= m; set_nz(s, s->a); break;
+    case OP_EOR: s->a ^= m; set_nz(s, s->a); break;
+    case OP_CMP: ref_compare(s, s->a, m); break;
+    case OP_CPX: ref_compare(s, s->x, m); break;
+    case OP_CPY: ref_compare(s, s->y, m); break;
+    case OP_BIT: ref_bit(s, m); break;
+    case OP_LDA: s->a = m; set_nz(s, m); break;
+    case OP_LDX: s->x = m; set_nz(s, m); break;
+    case OP_LDY: s->y = m; set_nz(s, m); break;
+    default: break;
+  }
+}
+
+// Implied operations, including the accumulator shifts.
+static void ref_implied_op(ref_state *s, op_t op) {
+  switch (op) {
+    case OP_ASL: case OP_LSR: case OP_ROL: case OP_ROR:
+      s->a = ref_shift(s, op, s->a);
+      break;
+    case OP_DEX: s->x--; set_nz(s, s->x); break;
+    case OP_DEY: s->y--; set_nz(s, s->y); break;
+    case OP_INX: s->x++; set_nz(s, s->x); break;
+    case OP_INY: s->y++; set_nz(s, s->y); break;
+    case OP_TAX: s->x = s->a; set_nz(s, s->x); break;
+    case OP_TAY: s->y = s->a; set_nz(s, s->y); break;
+    case OP_TSX: s->x = s->sp; set_nz(s, s->x); break;
+    case OP_TXA: s->a = s->x; set_nz(s, s->a); break;
+    case OP_TXS: s->sp = s->x; break;
+    case OP_TYA: s->a = s->y; set_nz(s, s->a); break;
+    case OP_CLC: set_flag(s, F_C, 0); break;
+    case OP_CLD: set_flag(s, F_D, 0); break;
+    case OP_CLI: set_flag(s, F_I, 0); break;
+    case OP_CLV: set_flag(s, F_V, 0); break;
+    case OP_SEC: set_flag(s, F_C, 1); break;
+    case OP_SED: set_flag(s, F_D, 1); break;
+    case OP_SEI: set_flag(s, F_I, 1); break;
+    case OP_PHA: ref_push(s, s->a); break;
+    case OP_PHP: ref_push(s, s->p | F_B | F_U); break;
+    case OP_PLA: s->a = ref_pull(s); set_nz(s, s->a); break;
+    case OP_PLP: ref_set_p(s, ref_pull(s)); break;
+    case OP_RTS: {
+      uint8_t lo = ref_pull(s), hi = ref_pull(s);
+      s->pc = (hi * 256 + lo + 1) & 0xFFFF;
+      break;
+    }
+    case OP_RTI: {
+      ref_set_p(s, ref_pull(s));
+      uint8_t lo = ref_pull(s), hi = ref_pull(s);
+      s->pc = hi * 256 + lo;
+      break;
+    }
+    case OP_BRK: set_flag(s, F_B, 1); break;
+    default: break;
+  }
+}
+
+// Operations on a memory address.
+static void ref_memory_op(ref_state *s, op_t op, uint16_t addr) {
+  switch (op) {
+    case OP_ASL: case OP_LSR: case OP_ROL: case OP_ROR:
+      ref_mem[addr] = ref_shift(s, op, ref_mem[addr]);
+      break;
+    case OP_INC: ref_mem[addr]++; set_nz(s, ref_mem[addr]); break;
+    case OP_DEC: ref_mem[addr]--; set_nz(s, ref_mem[addr]); break;
+    case OP_STA: ref_mem[addr] = s->a; break;
+    case OP_STX: ref_mem[addr] = s->x; break;
+    case OP_STY: ref_mem[addr] = s->y; break;
+    case OP_JMP: s->pc = addr; break;
+    case OP_JSR:
+      ref_push(s, ((s->pc - 1) >> 8) & 0xFF);
+      ref_push(s, (s->pc - 1) & 0xFF);
+      s->pc = addr;
+      break;
+    default: break;
+  }
+}
+
+// Interrupt entry, taken only while I is clear.
+static void ref_irq(ref_state *s) {
+  if (s->p & F_I) return;
+  ref_push(s, s->pc >> 8);
+  ref_push(s, s->pc & 0xFF);
+  ref_push(s, (s->p & ~F_B) | F_U);
+  s->p |= F_I;
+  s->pc = ref_mem[0xFFFE] + ref_mem[0xFFFF] * 256;
+  s->cycles += 7;
+}
+
+// ------------------------------------------------------------------
+// Reference decoder, working from the aaabbbcc opcode layout
+
+typedef struct { int valid; op_t op; addr_mode mode; } ref_decoded;
+
+static ref_decoded ref_decode(uint8_t opcode) {
+  static const op_t group1[8] = {OP_ORA, OP_AND, OP_EOR, OP_ADC, OP_STA, OP_LDA, OP_CMP, OP_SBC};
+  static const addr_mode modes1[8] = {MODE_IZX, MODE_ZP, MODE_IMM, MODE_ABS,
+                                      MODE_IZY, MODE_ZPX, MODE_ABY, MODE_ABX};
+  static const op_t group2[8] = {OP_ASL, OP_ROL, OP_LSR, OP_ROR, OP_STX, OP_LDX, OP_DEC, OP_INC};
+  static const op_t group0[8] = {0, OP_BIT, OP_JMP, OP_JMP, OP_STY, OP_LDY, OP_CPY, OP_CPX};
+  static const op_t branches[8] = {OP_BPL, OP_BMI, OP_BVC, OP_BVS, OP_BCC, OP_BCS, OP_BNE, OP_BEQ};
+  static const struct { uint8_t opcode; op_t op; } singles[] = {
+    {0x00, OP_BRK}, {0x20, OP_JSR}, {0x40, OP_RTI}, {0x60, OP_RTS},
+    {0x08, OP_PHP}, {0x28, OP_PLP}, {0x48, OP_PHA}, {0x68, OP_PLA},
+    {0x88, OP_DEY}, {0xA8, OP_TAY}, {0xC8, OP_INY}, {0xE8, OP_INX},
+    {0x18, OP_CLC}, {0x38, OP_SEC}, {0x58, OP_CLI}, {0x78, OP_SEI},
+    {0x98, OP_TYA}, {0xB8, OP_CLV}, {0xD8, OP_CLD}, {0xF8, OP_SED},
+    {0x8A, OP_TXA}, {0x9A, OP_TXS}, {0xAA, OP_TAX}, {0xBA, OP_TSX},
+    {0xCA, OP_DEX}, {0xEA, OP_NOP},
+  };
+  ref_decoded d = {0, OP_NOP, MODE_IMP};
+  int aaa = opcode >> 5, bbb = (opcode >> 2) & 7, cc = opcode & 3;
+
+  for (size_t i = 0; i < sizeof singles / sizeof singles[0]; i++)
+    if (singles[i].opcode == opcode) {
+      d.valid = 1;
+      d.op = singles[i].op;
+      if (opcode == 0x20) d.mode = MODE_ABS;
+      return d;
+    }
+  if ((opcode & 0x1F) == 0x10) {
+    d.valid = 1;
+    d.op = branches[opcode >> 5];
+    d.mode = MODE_REL;
+    return d;
+  }
+
+  if (cc == 1) {
+    d.op = group1[aaa];
+    d.mode = modes1[bbb];
+    d.valid = !(d.op == OP_STA && d.mode == MODE_IMM);
+  } else if (cc == 2) {
+    d.op = group2[aaa];
+    int stx_ldx = (d.op == OP_STX || d.op == OP_LDX);
+    switch (bbb) {
+      case 0: d.mode = MODE_IMM; d.valid = (d.op == OP_LDX); break;
+      case 1: d.mode = MODE_ZP; d.valid = 1; break;
+      case 2: d.mode = MODE_ACC; d.valid = (aaa < 4); break;
+      case 3: d.mode = MODE_ABS; d.valid = 1; break;
+      case 5: d.mode = stx_ldx ? MODE_ZPY : MODE_ZPX; d.valid = 1; break;
+      case 7: d.mode = stx_ldx ? MODE_ABY : MODE_ABX; d.valid = (d.op != OP_STX); break;
+    }
+  } else if (cc == 0 && aaa != 0) {
+    d.op = group0[aaa];
+    switch (bbb) {
+      case 0: d.mode = MODE_IMM; d.valid = (aaa >= 5); break;
+      case 1: d.mode = MODE_ZP; d.valid = (aaa != 2 && aaa != 3); break;
+      case 3: d.mode = (aaa == 3) ? MODE_IND : MODE_ABS; d.valid = 1; break;
+      case 5: d.mode = MODE_ZPX; d.valid = (aaa == 4 || aaa == 5); break;
+      case 7: d.mode = MODE_ABX; d.valid = (aaa == 5); break;
+    }
+  }
+  return d;
+}
+
+static int is_read_op(op_t op) {
+  switch (op) {
+    case OP_ADC: case OP_AND: case OP_BIT: case OP_CMP: case OP_CPX: case OP_CPY:
+    case OP_EOR: case OP_LDA: case OP_LDX: case OP_LDY: case OP_ORA: case OP_SBC:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static int is_rmw_op(op_t op) {
+  return op == OP_ASL || op == OP_LSR || op == OP_ROL || op == OP_ROR ||
+         op == OP_INC || op == OP_DEC;
+}
+
+// A CPU_FAST build of cpu.c only charges each opcode's base cycles.
+#ifdef CPU_FAST
+#define REF_EXACT_CYCLES 0
+#else
+#define REF_EXACT_CYCLES 1
+#endif
+
+static void ref_step(ref_state *s) {
+  ref_decoded d = ref_decode(ref_mem[s->pc]);
+  if (!d.valid) { s->stop = STOP_ILLEGAL; return; }
+
+  uint8_t lo = ref_mem[(s->pc + 1) & 0xFFFF];
+  uint8_t hi = ref_mem[(s->pc + 2) & 0xFFFF];
+  uint16_t abs = hi * 256 + lo, base = 0, ea = 0;
+  int size = 1, cycles = 2, crossed = 0;
+
+  switch (d.mode) {
+    case MODE_IMP: case MODE_ACC: break;
+    case MODE_IMM: case MODE_REL: size = 2; break;
+    case MODE_ZP:  size = 2; ea = lo; break;
+    case MODE_ZPX: size = 2; ea = (lo + s->x) % 256; break;
+    case MODE_ZPY: size = 2; ea = (lo + s->y) % 256; break;
+    case MODE_ABS: size = 3; ea = abs; break;
+    case MODE_ABX: size = 3; base = abs; ea = (abs + s->x) & 0xFFFF; crossed = (ea >> 8) != hi; break;
+    case MODE_ABY: size = 3; base = abs; ea = (abs + s->y) & 0xFFFF; crossed = (ea >> 8) != hi; break;
+    case MODE_IND:
+      size = 3;
+      ea = ref_mem[abs] + ref_mem[(abs & 0xFF00) + ((lo + 1) % 256)] * 256;
+      break;
+    case MODE_IZX: {
+      uint8_t zp = (lo + s->x) % 256;
+      size = 2;
+      ea = ref_mem[zp] + ref_mem[(zp + 1) % 256] * 256;
+      break;
+    }
+    case MODE_IZY:
+      size = 2;
+      base = ref_mem[lo] + ref_mem[(lo + 1) % 256] * 256;
+      ea = (base + s->y) & 0xFFFF;
+      crossed = (ea >> 8) != (base >> 8);
+      break;
+  }
+  (void)base;
+  s->pc = (s->pc + size) & 0xFFFF;
+
+  // cycle counts from the NMOS datasheet
+  if (is_read_op(d.op) || d.op == OP_STA || d.op == OP_STX || d.op == OP_STY) {
+    static const uint8_t by_mode[] = {
+      [MODE_IMM] = 2, [MODE_ZP] = 3, [MODE_ZPX] = 4, [MODE_ZPY] = 4,
+      [MODE_ABS] = 4, [MODE_ABX] = 4, [MODE_ABY] = 4, [MODE_IZX] = 6,
+      [MODE_IZY] = 5,
+    };
+    cycles = by_mode[d.mode];
+    if (is_read_op(d.op)) cycles += crossed * REF_EXACT_CYCLES;
+    else if (d.mode == MODE_ABX || d.mode == MODE_ABY || d.mode == MODE_IZY) cycles++;
+  } else if (is_rmw_op(d.op) && d.mode != MODE_ACC) {
+    cycles = d.mode == MODE_ZP ? 5 : d.mode == MODE_ABX ? 7 : 6;
+  } else {
+    switch (d.op) {
+      case OP_JMP: cycles = d.mode == MODE_IND ? 5 : 3; break;
+      case OP_JSR: case OP_RTS: case OP_RTI: cycles = 6; break;
+      case OP_BRK: cycles = 7; break;
+      case OP_PHA: case OP_PHP: cycles = 3; break;
+      case OP_PLA: case OP_PLP: cycles = 4; break;
+      default: cycles = 2; break;
+    }
+  }
+
+  if (d.mode == MODE_REL) {
+    if (ref_branch_taken(s, d.op)) {
+      uint16_t target = (s->pc + as_signed(lo)) & 0xFFFF;
+      cycles += (1 + ((target >> 8) != (s->pc >> 8))) * REF_EXACT_CYCLES;
+      s->pc = target;
+    }
+  } else if (d.op == OP_BRK) {
+    s->pc = (s->pc + 1) & 0xFFFF;
+    ref_implied_op(s, d.op);
+    s->stop = STOP_BRK;
+  } else if (d.mode == MODE_IMM) {
+    ref_value_op(s, d.op, lo);
+  } else if (is_read_op(d.op)) {
+    ref_value_op(s, d.op, ref_mem[ea]);
+  } else if (d.mode == MODE_IMP || d.mode == MODE_ACC) {
+    ref_implied_op(s, d.op);
+  } else {
+    ref_memory_op(s, d.op, ea);
+  }
+  s->cycles += cycles;
+}
+
+// ------------------------------------------------------------------
+// Running cpu.c against the reference
+
+static void load_cpu(cpu6502 *cpu, const ref_state *s) {
+  cpu->A = s->a;
+  cpu->X = s->x;
+  cpu->Y = s->y;
+  cpu->SP = s->sp;
+  cpu->PC = s->pc;
+  status_from_byte_c(&cpu->P, s->p);
+  cpu->P.B = (s->p & F_B) != 0;
+  cpu->P.U = (s->p & F_U) != 0;
+  cpu->cycles = s->cycles;
+  cpu->stop = STOP_NONE;
+}
+
+static int same_state(const cpu6502 *cpu, const ref_state *s) {
+  uint8_t mask = ~s->ignore;
+  return cpu->A == s->a && cpu->X == s->x && cpu->Y == s->y &&
+         cpu->SP == s->sp && cpu->PC == s->pc &&
+         (status_to_byte_c(cpu->P) & mask) == (s->p & mask) &&
+         cpu->cycles == s->cycles && cpu->stop == s->stop;
+}
+
+static void report_state(const char *what, const ref_state *in, const cpu6502 *cpu,
+                         const ref_state *want) {
+  report("%s: in A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X | "
+         "got A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X cyc=%llu stop=%d | "
+         "want A=%02X X=%02X Y=%02X SP=%02X P=%02X PC=%04X cyc=%llu stop=%d",
+         what, in->a, in->x, in->y, in->sp, in->p, in->pc,
+         cpu->A, cpu->X, cpu->Y, cpu->SP, status_to_byte_c(cpu->P), cpu->PC,
+         (unsigned long long)cpu->cycles, cpu->stop,
+         want->a, want->x, want->y, want->sp, want->p, want->pc,
+         (unsigned long long)want->cycles, want->stop);
+}
+
+static ref_state random_state(uint64_t *rng) {
+  uint64_t r = rng_next(rng);
+  ref_state s = {0};
+  s.a = r;
+  s.x = r >> 8;
+  s.y = r >> 16;
+  s.sp = r >> 24;
+  s.p = (r >> 32) | F_U;
+  s.pc = r >> 40;
+  return s;
+}
+
+static const char *op_name(op_t op) {
+  static const char *names[] = {
+    "ADC","AND","ASL","BCC","BCS","BEQ","BIT","BMI","BNE","BPL","BRK","BVC",
+    "BVS","CLC","CLD","CLI","CLV","CMP","CPX","CPY","DEC","DEX","DEY","EOR",
+    "INC","INX","INY","JMP","JSR","LDA","LDX","LDY","LSR","NOP","ORA","PHA",
+    "PHP","PLA","PLP","ROL","ROR","RTI","RTS","SBC","SEC","SED","SEI","STA",
+    "STX","STY","TAX","TAY","TSX","TXA","TXS","TYA"
+  };
+  return names[op];
+}
+
+// Value operations: every register value x M x C x D, other state random.
+static const op_t value_ops[] = {
+  OP_ADC, OP_SBC, OP_AND, OP_ORA, OP_EOR, OP_CMP, OP_CPX, OP_CPY,
+  OP_BIT, OP_LDA, OP_LDX, OP_LDY,
+};
+
+static void cpu_value_op(cpu6502 *cpu, op_t op, uint8_t m) {
+  switch (op) {
+    case OP_ADC: ADC_c(cpu, m); break;
+    case OP_SBC: SBC_c(cpu, m); break;
+    case OP_AND: AND_c(cpu, m); break;
+    case OP_ORA: ORA_c(cpu, m); break;
+    case OP_EOR: EOR_c(cpu, m); break;
+    case OP_CMP: CMP_c(cpu, m); break;
+    case OP_CPX: CPX_c(cpu, m); break;
+    case OP_CPY: CPY_c(cpu, m); break;
+    case OP_BIT: BIT_c(cpu, m); break;
+    case OP_LDA: LDA_c(cpu, m); break;
+    case OP_LDX: LDX_c(cpu, m); break;
+    case OP_LDY: LDY_c(cpu, m); break;
+    default: break;
+  }
+}
+
+static void unit_value_op(int unit, int arg) {
+  op_t op = value_ops[arg >> 8];
+  uint8_t reg = arg & 0xFF;
+  uint64_t rng = rng_seed(unit);
+  for (int m = 0; m < 0x100; m++)
+    for (int cd = 0; cd < 4; cd++) {
+      ref_state in = random_state(&rng);
+      if (op == OP_CPX) in.x = reg; else if (op == OP_CPY) in.y = reg; else in.a = reg;
+      in.p = (in.p & ~(F_C | F_D)) | ((cd & 1) ? F_C : 0) | ((cd & 2) ? F_D : 0);
+      ref_state want = in;
+      ref_value_op(&want, op, m);
+      if (want.skip) continue;
+      cpu6502 cpu;
+      load_cpu(&cpu, &in);
+      cpu_value_op(&cpu, op, m);
+      if (!same_state(&cpu, &want)) {
+        char what[32];
+        snprintf(what, sizeof what, "%s #$%02X", op_name(op), m);
+        report_state(what, &in, &cpu, &want);
+      }
+      atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+    }
+}
+
+// Register-only implied operations: every register value x every P.
+static const op_t implied_ops[] = {
+  OP_ASL, OP_LSR, OP_ROL, OP_ROR, OP_DEX, OP_DEY, OP_INX, OP_INY,
+  OP_TAX, OP_TAY, OP_TSX, OP_TXA, OP_TXS, OP_TYA, OP_CLC, OP_CLD,
+  OP_CLI, OP_CLV, OP_SEC, OP_SED, OP_SEI, OP_NOP, OP_BRK,
+};
+
+static void cpu_implied_op(cpu6502 *cpu, op_t op) {
+  switch (op) {
+    case OP_ASL: ASL_A_c(cpu); break;
+    case OP_LSR: LSR_A_c(cpu); break;
+    case OP_ROL: ROL_A_c(cpu); break;
+    case OP_ROR: ROR_A_c(cpu); break;
+    case OP_DEX: DEX_c(cpu); break;
+    case OP_DEY: DEY_c(cpu); break;
+    case OP_INX: INX_c(cpu); break;
+    case OP_INY: INY_c(cpu); break;
+    case OP_TAX: TAX_c(cpu); break;
+    case OP_TAY: TAY_c(cpu); break;
+    case OP_TSX: TSX_c(cpu); break;
+    case OP_TXA: TXA_c(cpu); break;
+    case OP_TXS: TXS_c(cpu); break;
+    case OP_TYA: TYA_c(cpu); break;
+    case OP_CLC: CLC_c(cpu); break;
+    case OP_CLD: CLD_c(cpu); break;
+    case OP_CLI: CLI_c(cpu); break;
+    case OP_CLV: CLV_c(cpu); break;
+    case OP_SEC: SEC_c(cpu); break;
+    case OP_SED: SED_c(cpu); break;
+    case OP_SEI: SEI_c(cpu); break;
+    case OP_NOP: NOP_c(cpu); break;
+    case OP_BRK: BRK_c(cpu); break;
+    case OP_PHA: PHA_c(cpu); break;
+    case OP_PHP: PHP_c(cpu); break;
+    case OP_PLA: LDA_c(cpu, PLA_c(cpu)); break;
+    case OP_PLP: PLP_c(cpu); break;
+    case OP_RTS: RTS_c(cpu); break;
+    case OP_RTI: RTI_c(cpu); break;
+    default: break;
+  }
+}
+
+static void unit_implied_op(int unit, int arg) {
+  op_t op = implied_ops[arg >> 8];
+  uint8_t p = arg & 0xFF;
+  uint64_t rng = rng_seed(unit);
+  for (int v = 0; v < 0x100; v++) {
+    ref_state in = random_state(&rng);
+    in.a = in.x = in.y = in.sp = v;
+    in.p = p | F_U;
+    ref_state want = in;
+    ref_implied_op(&want, op);
+    cpu6502 cpu;
+    load_cpu(&cpu, &in);
+    cpu_implied_op(&cpu, op);
+    if (!same_state(&cpu, &want)) report_state(op_name(op), &in, &cpu, &want);
+    atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+  }
+}
+
+// Branches: every P x offset from a random PC.
+static const op_t branch_ops[] = {
+  OP_BCC, OP_BCS, OP_BEQ, OP_BMI, OP_BNE, OP_BPL, OP_BVC, OP_BVS,
+};
+
+static int cpu_branch(cpu6502 *cpu, op_t op, uint8_t offset) {
+  switch (op) {
+    case OP_BCC: return BCC_c(cpu, offset);
+    case OP_BCS: return BCS_c(cpu, offset);
+    case OP_BEQ: return BEQ_c(cpu, offset);
+    case OP_BMI: return BMI_c(cpu, offset);
+    case OP_BNE: return BNE_c(cpu, offset);
+    case OP_BPL: return BPL_c(cpu, offset);
+    case OP_BVC: return BVC_c(cpu, offset);
+    default:     return BVS_c(cpu, offset);
+  }
+}
+
+static void unit_branch(int unit, int arg) {
+  op_t op = branch_ops[arg >> 8];
+  uint8_t p = arg & 0xFF;
+  uint64_t rng = rng_seed(unit);
+  for (int offset = 0; offset < 0x100; offset++) {
+    ref_state in = random_state(&rng);
+    in.p = p | F_U;
+    ref_state want = in;
+    int taken = ref_branch_taken(&want, op);
+    if (taken) want.pc = (want.pc + as_signed(offset)) & 0xFFFF;
+    cpu6502 cpu;
+    load_cpu(&cpu, &in);
+    int cpu_taken = cpu_branch(&cpu, op, offset);
+    if (!same_state(&cpu, &want) || cpu_taken != taken) {
+      char what[32];
+      snprintf(what, sizeof what, "%s $%02X", op_name(op), offset);
+      report_state(what, &in, &cpu, &want);
+    }
+    atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+  }
+}
+
+// Memory and stack operations: every value x every P, random address and SP.
+static const op_t memory_ops[] = {
+  OP_ASL, OP_LSR, OP_ROL, OP_ROR, OP_INC, OP_DEC, OP_STA, OP_STX, OP_STY,
+  OP_JMP, OP_JSR, OP_PHA, OP_PHP, OP_PLA, OP_PLP, OP_RTS, OP_RTI,
+};
+
+static void cpu_memory_op(cpu6502 *cpu, op_t op, uint16_t addr) {
+  switch (op) {
+    case OP_ASL: ASL_c(cpu, addr); break;
+    case OP_LSR: LSR_c(cpu, addr); break;
+    case OP_ROL: ROL_c(cpu, addr); break;
+    case OP_ROR: ROR_c(cpu, addr); break;
+    case OP_INC: INC_c(cpu, addr); break;
+    case OP_DEC: DEC_c(cpu, addr); break;
+    case OP_STA: STA_c(cpu, addr); break;
+    case OP_STX: STX_c(cpu, addr); break;
+    case OP_STY: STY_c(cpu, addr); break;
+    case OP_JMP: JMP_c(cpu, addr); break;
+    case OP_JSR: JSR_c(cpu, addr); break;
+    default: cpu_implied_op(cpu, op); break;
+  }
+}
+
+static void unit_memory_op(int unit, int arg) {
+  op_t op = memory_ops[arg >> 8];
+  uint8_t p = arg & 0xFF;
+  uint64_t rng = rng_seed(unit);
+  for (int v = 0; v < 0x100; v++) {
+    ref_state in = random_state(&rng);
+    in.p = p | F_U;
+    uint16_t addr = rng_next(&rng);
+    // the value under test sits at addr and in every stack slot touched
+    uint16_t cells[4] = {addr, 0x100 | ((in.sp + 1) & 0xFF),
+                         0x100 | ((in.sp + 2) & 0xFF), 0x100 | ((in.sp + 3) & 0xFF)};
+    uint16_t stack_out[2] = {0x100 | in.sp, 0x100 | ((in.sp - 1) & 0xFF)};
+    for (int i = 0; i < 4; i++) memory[cells[i]] = ref_mem[cells[i]] = v ^ (i * 0x55);
+    for (int i = 0; i < 2; i++) memory[stack_out[i]] = ref_mem[stack_out[i]] = ~v;
+
+    ref_state want = in;
+    if (op == OP_PHA || op == OP_PHP || op == OP_PLA || op == OP_PLP ||
+        op == OP_RTS || op == OP_RTI)
+      ref_implied_op(&want, op);
+    else
+      ref_memory_op(&want, op, addr);
+    cpu6502 cpu;
+    load_cpu(&cpu, &in);
+    cpu_memory_op(&cpu, op, addr);
+
+    int same = same_state(&cpu, &want);
+    for (int i = 0; i < 4; i++) same &= (memory[cells[i]] == ref_mem[cells[i]]);
+    for (int i = 0; i < 2; i++) same &= (memory[stack_out[i]] == ref_mem[stack_out[i]]);
+    if (!same) {
+      char what[32];
+      snprintf(what, sizeof what, "%s $%04X (M=%02X)", op_name(op), addr, v);
+      report_state(what, &in, &cpu, &want);
+    }
+    atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+  }
+}
+
+// Interrupt entry: every P, random registers, stack pointer and vector.
+static void unit_irq(int unit, int arg) {
+  uint8_t p = arg & 0xFF;
+  uint64_t rng = rng_seed(unit);
+  for (int n = 0; n < 0x100; n++) {
+    ref_state in = random_state(&rng);
+    in.p = p | F_U;
+    uint16_t vector = rng_next(&rng);
+    memory[0xFFFE] = ref_mem[0xFFFE] = vector & 0xFF;
+    memory[0xFFFF] = ref_mem[0xFFFF] = vector >> 8;
+    uint16_t stack[3];
+    for (int i = 0; i < 3; i++) {
+      stack[i] = 0x100 | ((in.sp - i) & 0xFF);
+      memory[stack[i]] = ref_mem[stack[i]] = n;
+    }
+
+    ref_state want = in;
+    ref_irq(&want);
+    cpu6502 cpu;
+    load_cpu(&cpu, &in);
+    irq_c(&cpu);
+
+    int same = same_state(&cpu, &want);
+    for (int i = 0; i < 3; i++) same &= (memory[stack[i]] == ref_mem[stack[i]]);
+    if (!same) report_state("IRQ", &in, &cpu, &want);
+    atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+  }
+}
+
+// Whole instructions through step_c() against ref_step(), with random
+// memory, registers and operands.
+
+// Every cell an instruction with these operand bytes could write from state
+// s, including where an index that failed to wrap in zero page would land.
+// Reads ref_mem, so call it before stepping.
+#define DECODER_CELLS 15
+static void decoder_cells(const ref_state *s, uint8_t lo, uint8_t hi, uint16_t *cells) {
+  uint16_t abs = hi * 256 + lo;
+  uint8_t zx = lo + s->x;
+  int n = 0;
+  cells[n++] = lo;
+  cells[n++] = zx;
+  cells[n++] = lo + s->x;
+  cells[n++] = (lo + s->y) & 0xFF;
+  cells[n++] = lo + s->y;
+  cells[n++] = abs;
+  cells[n++] = abs + s->x;
+  cells[n++] = abs + s->y;
+  cells[n++] = ref_mem[zx] + ref_mem[(zx + 1) & 0xFF] * 256;
+  cells[n++] = ref_mem[lo] + ref_mem[(lo + 1) & 0xFF] * 256 + s->y;
+  for (int i = -2; i <= 2; i++) cells[n++] = 0x100 | ((s->sp + i) & 0xFF);
+}
+
+static void unit_decoder(int unit, int arg) {
+  (void)arg;
+  uint64_t rng = rng_seed(unit);
+  for (int i = 0; i < 0x10000; i += 8) {
+    uint64_t r = rng_next(&rng);
+    memcpy(memory + i, &r, 8);
+  }
+  memcpy(ref_mem, memory, sizeof ref_mem);
+
+  // only the cells an instruction can write are compared after each step;
+  // one full compare at the end catches writes anywhere else
+  for (int n = 0; n < DECODER_CASES_PER_UNIT; n++) {
+    ref_state in = random_state(&rng);
+    in.cycles = rng_next(&rng) >> 40;
+    uint8_t opcode;
+    do opcode = rng_next(&rng); while (!ref_decode(opcode).valid);
+    uint8_t lo = rng_next(&rng), hi = rng_next(&rng);
+    memory[in.pc] = ref_mem[in.pc] = opcode;
+    memory[(in.pc + 1) & 0xFFFF] = ref_mem[(in.pc + 1) & 0xFFFF] = lo;
+    memory[(in.pc + 2) & 0xFFFF] = ref_mem[(in.pc + 2) & 0xFFFF] = hi;
+    uint16_t cells[DECODER_CELLS];
+    decoder_cells(&in, lo, hi, cells);
+
+    ref_state want = in;
+    ref_step(&want);
+    cpu6502 cpu;
+    load_cpu(&cpu, &in);
+    step_c(&cpu);
+
+    int same = same_state(&cpu, &want);
+    for (int i = 0; i < DECODER_CELLS; i++) same &= (memory[cells[i]] == ref_mem[cells[i]]);
+    if (!same && !want.skip) {
+      char what[48];
+      snprintf(what, sizeof what, "step %02X %02X %02X", opcode, lo, hi);
+      report_state(what, &in, &cpu, &want);
+    }
+    if (!same)
+      for (int i = 0; i < DECODER_CELLS; i++) ref_mem[cells[i]] = memory[cells[i]];
+    if (!want.skip) atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+  }
+  if (memcmp(memory, ref_mem, sizeof ref_mem) != 0)
+    report("decoder unit %d: step_c wrote outside the cells it may touch", unit);
+}
+
+// The decoder and opcode_table must agree on which opcodes exist.
+static void unit_opcode_table(int unit, int arg) {
+  (void)unit;
+  (void)arg;
+  for (int opcode = 0; opcode < 0x100; opcode++) {
+    ref_decoded d = ref_decode(opcode);
+    const opcode_info *info = &opcode_table[opcode];
+    if (d.valid != (info->cycles != 0) ||
+        (d.valid && (d.op != info->op || d.mode != info->mode)))
+      report("opcode_table[%02X]: op %d mode %d, reference %s op %d mode %d", opcode,
+             info->op, info->mode, d.valid ? "valid" : "invalid", d.op, d.mode);
+    atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+  }
+}
+
+// Label n, or its address when numeric is set.
+static const char *jump_target(char *buf, int label, const uint16_t *addrs, int numeric) {
+  if (numeric) snprintf(buf, 8, "$%04X", addrs[label]);
+  else snprintf(buf, 8, "L%d", label);
+  return buf;
+}
+
+// Straight-line code at $0600 with forward branches and jumps, so every
+// program ends at its BRK. Operands come from a few values so that loads
+// and flags repeat often enough for the optimizer to find something to
+// remove. The generator keeps track of the address it is at, so it fills
+// addrs with where each label lands without assembling anything; run again
+// from the same rng state with numeric set, it writes the same program with
+// some branch and jump targets as numbers. Returns -1 if a branch ended up
+// out of range.
+static int random_program(uint64_t *rng, char *src, size_t size, uint16_t *addrs,
+                          int numeric) {
+  static const char *implied[] = {
+    "TAX", "TAY", "TXA", "TYA", "INX", "DEX", "INY", "DEY", "CLC", "SEC",
+    "CLV", "CLI", "SEI", "PHA", "PLA", "PHP", "PLP", "NOP", "ASL A", "ROR A",
+  };
+  static const char *with_value[] = {"LDA", "LDX", "LDY", "AND", "ORA", "EOR",
+                                     "ADC", "SBC", "CMP", "CPX"};
+  static const char *with_addr[] = {"LDA", "STA", "STX", "STY", "INC", "ASL", "BIT"};
+  static const char *branches[] = {"BCC", "BCS", "BEQ", "BNE", "BMI", "BPL", "BVC", "BVS"};
+  static const uint8_t values[] = {0x00, 0x01, 0x7F, 0x80, 0xFF};
+
+  size_t n = 0;
+  int labels = 0, branch_count = 0;
+  uint16_t pc = 0x0600, branch_from[PEEPHOLE_LENGTH];
+  int branch_to[PEEPHOLE_LENGTH];
+  char to[8], to_jmp[8];
+  n += snprintf(src + n, size - n, "LDA #$%02X\nPHA\nPLP\n", (uint8_t)rng_next(rng) & ~F_D);
+  pc += 4;
+  for (int i = 0; i < PEEPHOLE_LENGTH; i++) {
+    uint64_t r = rng_next(rng);
+    uint8_t v = r & 8 ? values[(r >> 8) % COUNT(values)] : (uint8_t)(r >> 16);
+    int target = labels + (int)((r >> 32) % 3);
+    switch ((r >> 4) % 8) {
+      case 0: case 1:
+        n += snprintf(src + n, size - n, "%s\n", implied[(r >> 24) % COUNT(implied)]);
+        pc += 1;
+        break;
+      case 2: case 3:
+        n += snprintf(src + n, size - n, "%s #$%02X\n",
+                      with_value[(r >> 24) % COUNT(with_value)], v);
+        pc += 2;
+        break;
+      case 4: {
+        // wide zero page operands are what the optimizer shortens
+        int addr = (r >> 40) % 4 ? v & 0x0F : 0x300;
+        n += snprintf(src + n, size - n, r & 0x100000000 ? "%s $%02X\n" : "%s $%04X\n",
+                      with_addr[(r >> 24) % COUNT(with_addr)], addr);
+        pc += r & 0x100000000 && addr < 0x100 ? 2 : 3;
+        break;
+      }
+      case 5:
+        n += snprintf(src + n, size - n, "%s %s\n", branches[(r >> 24) % COUNT(branches)],
+                      jump_target(to, target, addrs, numeric && ((r >> 36) & 1)));
+        pc += 2;
+        branch_from[branch_count] = pc;
+        branch_to[branch_count++] = target;
+        break;
+      case 6:
+        n += snprintf(src + n, size - n, "%s %s\nJMP %s\nL%d:\n",
+                      branches[(r >> 24) % COUNT(branches)],
+                      jump_target(to, labels, addrs, numeric && ((r >> 36) & 1)),
+                      jump_target(to_jmp, labels + 1, addrs, numeric && ((r >> 37) & 1)),
+                      labels);
+        pc += 5;
+        addrs[labels++] = pc;
+        break;
+      default:
+        n += snprintf(src + n, size - n, "L%d:\n", labels);
+        addrs[labels++] = pc;
+        break;
+    }
+  }
+  // define every label a branch may still be waiting for
+  for (int i = 0; i < 3; i++) {
+    n += snprintf(src + n, size - n, "L%d:\n", labels + i);
+    addrs[labels + i] = pc;
+  }
+  snprintf(src + n, size - n, "STA $0300\nSTX $0301\nSTY $0302\nBRK\n");
+
+  for (int i = 0; i < branch_count; i++)
+    if (addrs[branch_to[i]] - branch_from[i] > 127) return -1;
+  return 0;
+}
+
+static void unit_peephole(int unit, int arg) {
+  (void)arg;
+  uint64_t rng = rng_seed(unit);
+  char src[4096];
+  uint8_t *plain = malloc(0x10000), *optimized = malloc(0x10000);
+  for (int n = 0; n < PEEPHOLE_CASES_PER_UNIT; n++) {
+    uint16_t addrs[PEEPHOLE_LABELS];
+    uint64_t start = rng;
+    if (random_program(&rng, src, sizeof src, addrs, 0) != 0) continue;
+    random_program(&start, src, sizeof src, addrs, 1);
+    // building doesn't touch memory, so only the runs hold the lock
+    size_t plain_len, optimized_len;
+    uint64_t before, after;
+    int same = (peephole_build(src, 0x0600, plain, &plain_len, optimized, &optimized_len) == 0);
+    if (same) {
+      pthread_mutex_lock(&memory_lock);
+      same = (peephole_compare(plain, plain_len, optimized, optimized_len, 0x0600, 1000,
+                               &before, &after) == 0);
+      pthread_mutex_unlock(&memory_lock);
+    }
+    if (!same) report("peephole changed the behaviour of:\n%s", src);
+    atomic_fetch_add_explicit(&cases_run, 1, memory_order_relaxed);
+  }
+  free(plain);
+  free(optimized);
+}
+
+// ------------------------------------------------------------------
+// Work distribution
+
+typedef struct {
+  void (*fn)(int unit, int arg);
+  int arg;
+  int locked; // touches memory
+} work_unit;
+
+static work_unit *units;
+static int unit_count;
+static atomic_int next_unit;
+
+static void add_units(void (*fn)(int, int), int ops, int per_op, int locked) {
+  for (int op = 0; op < ops; op++)
+    for (int i = 0; i < per_op; i++) {
+      units[unit_count].fn = fn;
+      units[unit_count].arg = (op << 8) | i;
+      units[unit_count].locked = locked;
+      unit_count++;
+    }
+}
+
+static void *worker(void *unused) {
+  (void)unused;
+  for (;;) {
+    int u = atomic_fetch_add(&next_unit, 1);
+    if (u >= unit_count) return NULL;
+    if (units[u].locked) pthread_mutex_lock(&memory_lock);
+    units[u].fn(u, units[u].arg);
+    if (units[u].locked) pthread_mutex_unlock(&memory_lock);
+  }
+}
+
+int main(int argc, char **argv) {
+  long threads = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+
+  init_encode_table(); // before the peephole units assemble on several threads
+  units = malloc(sizeof(work_unit) * 0x10000);
+  // memory-bound units first so they overlap with the register-only ones
+  add_units(unit_decoder, 1, DECODER_UNITS, 1);
+  add_units(unit_memory_op, COUNT(memory_ops), 0x100, 1);
+  add_units(unit_peephole, 1, PEEPHOLE_UNITS, 0); // locks around its runs itself
+  add_units(unit_irq, 1, 0x100, 1);
+  add_units(unit_opcode_table, 1, 1, 0);
+  add_units(unit_value_op, COUNT(value_ops), 0x100, 0);
+  add_units(unit_implied_op, COUNT(implied_ops), 0x100, 0);
+  add_units(unit_branch, COUNT(branch_ops), 0x100, 0);
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+  for (long i = 0; i < threads; i++) pthread_create(&tids[i], NULL, worker, NULL);
+  for (long i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  unsigned long cases = atomic_load(&cases_run), failed = atomic_load(&failures);
+  printf("%lu cases in %.2fs on %ld threads (%.1f M cases/s), %lu failures\n",
+         cases, secs, threads, cases / secs / 1e6, failed);
+  free(tids);
+  free(units);
+  return failed ? 1 : 0;
+}
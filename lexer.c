@@ -126,6 +126,7 @@ void token_free(Token *tok) {
   free(tok->behaviour);
   free(tok->cursor_skip);
   free(tok->previous_token);
+  free(tok->tktype);
 }
 
 bool is_mnemonic(const char *word) {
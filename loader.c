@@ -0,0 +1,289 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.c"
+
+// Loaders for getting programs into memory. Every loader returns 0 on
+// success and -1 if the file can't be read or doesn't fit in the 64K space.
+//
+//   load_raw       raw binary copied to a base address
+//   load_ihex      Intel HEX (records 00-05, 16-bit addresses only)
+//   load_segments  SEG65 container, see below
+//   map_rom        read-only image mapped straight from the file
+//
+// ROM images are mmap'd once per file and shared by every mapping in the
+// process, so loading the same ROM again costs neither a copy nor a read.
+
+#define ROM_IMAGES_MAX 16
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  const uint8_t *data;
+  size_t size;
+  unsigned int refs;
+} rom_image;
+
+static rom_image rom_images[ROM_IMAGES_MAX];
+static uint8_t rom_page_owner[0x100]; // image index + 1, 0 for RAM
+static uint16_t rom_map_pages[0x100]; // pages in the mapping that starts here, else 0
+
+static int read_whole_file(const char *path, uint8_t **data, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return -1;
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0) {
+    fclose(f);
+    return -1;
+  }
+  *size = st.st_size;
+  *data = malloc(*size + 1);
+  if (!*data || fread(*data, 1, *size, f) != *size) {
+    free(*data);
+    fclose(f);
+    return -1;
+  }
+  (*data)[*size] = '\0';
+  fclose(f);
+  return 0;
+}
+
+// A file too big for the space above base is refused before any of it is
+// read, so it leaves memory untouched.
+int load_raw(const char *path, uint16_t base) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return -1;
+  struct stat st;
+  size_t room = 0x10000 - base;
+  if (fstat(fileno(f), &st) != 0 || (size_t)st.st_size > room) {
+    fclose(f);
+    return -1;
+  }
+  size_t n = fread(memory + base, 1, room, f);
+  int too_big = (n == room && fgetc(f) != EOF);
+  fclose(f);
+  return too_big ? -1 : 0;
+}
+
+static int hex_byte(const char *s) {
+  int value = 0;
+  for (int i = 0; i < 2; i++) {
+    char c = s[i];
+    value <<= 4;
+    if (c >= '0' && c <= '9') value |= c - '0';
+    else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+    else return -1;
+  }
+  return value;
+}
+
+// Records are staged in a copy of memory and only committed once the whole
+// file has parsed, so a bad file leaves memory untouched.
+int load_ihex(const char *path) {
+  uint8_t *text;
+  size_t size;
+  if (read_whole_file(path, &text, &size) != 0) return -1;
+
+  static uint8_t staged[0x10000];
+  memcpy(staged, memory, sizeof staged);
+
+  int ok = 0;
+  const char *p = (const char *)text, *end = p + size;
+  while (*p) {
+    if (*p != ':') {
+      if (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t') { p++; continue; }
+      break;
+    }
+    p++;
+    int len = hex_byte(p);
+    if (len < 0 || (size_t)(end - p) < (size_t)(len + 5) * 2) break;
+
+    uint8_t rec[5 + 0xFF];
+    uint8_t sum = 0;
+    int i;
+    for (i = 0; i < len + 5; i++) {
+      int b = hex_byte(p + i * 2);
+      if (b < 0) break;
+      rec[i] = b;
+      sum += b;
+    }
+    if (i != len + 5 || sum != 0) break;
+    p += (len + 5) * 2;
+
+    uint16_t addr = (rec[1] << 8) | rec[2];
+    uint8_t type = rec[3];
+    if (type == 0x00) {
+      if (addr + len > 0x10000) break;
+      memcpy(staged + addr, rec + 4, len);
+    } else if (type == 0x01) {
+      ok = 1;
+      break;
+    } else if (type == 0x02 || type == 0x04) {
+      // extended addresses can only select the first 64K
+      if (len != 2 || rec[4] || rec[5]) break;
+    } else if (type != 0x03 && type != 0x05) {
+      break;
+    }
+  }
+
+  free(text);
+  if (!ok) return -1;
+  memcpy(memory, staged, sizeof staged);
+  return 0;
+}
+
+static int rom_image_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+
+  int free_slot = -1;
+  for (int i = 0; i < ROM_IMAGES_MAX; i++) {
+    if (rom_images[i].refs && rom_images[i].dev == st.st_dev &&
+        rom_images[i].ino == st.st_ino && rom_images[i].size == (size_t)st.st_size) {
+      close(fd);
+      return i;
+    }
+    if (!rom_images[i].refs && free_slot < 0) free_slot = i;
+  }
+  if (free_slot < 0) {
+    close(fd);
+    return -1;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return -1;
+
+  rom_image *img = &rom_images[free_slot];
+  img->dev = st.st_dev;
+  img->ino = st.st_ino;
+  img->data = data;
+  img->size = st.st_size;
+  img->refs = 0;
+  return free_slot;
+}
+
+static void rom_image_release(int index) {
+  rom_image *img = &rom_images[index];
+  if (img->refs == 0) {
+    munmap((void *)img->data, img->size);
+    img->data = NULL;
+  }
+}
+
+// Maps size bytes of the image at offset over base; both base and size must
+// be whole pages so that the page table can point straight into the file.
+static int rom_map_range(int index, size_t offset, uint16_t base, size_t size) {
+  rom_image *img = &rom_images[index];
+  if ((base & U8_MAX) || (size & U8_MAX) || size == 0 ||
+      base + size > 0x10000 || offset + size > img->size)
+    return -1;
+  for (size_t page = base >> 8; page < (base + size) >> 8; page++)
+    if (rom_page_owner[page]) return -1;
+
+  map_rom_pages(base >> 8, size >> 8, img->data + offset);
+  for (size_t page = base >> 8; page < (base + size) >> 8; page++)
+    rom_page_owner[page] = index + 1;
+  rom_map_pages[base >> 8] = size >> 8;
+  img->refs++;
+  return 0;
+}
+
+int map_rom(const char *path, uint16_t base) {
+  int index = rom_image_open(path);
+  if (index < 0) return -1;
+  if (rom_map_range(index, 0, base, rom_images[index].size) != 0) {
+    rom_image_release(index);
+    return -1;
+  }
+  return 0;
+}
+
+// Removes the ROM mapping that starts at base, dropping the file mapping
+// once nothing refers to it any more.
+void unmap_rom(uint16_t base) {
+  uint8_t page = base >> 8;
+  uint8_t owner = rom_page_owner[page];
+  unsigned int count = rom_map_pages[page];
+  if (!owner || !count || (base & U8_MAX)) return;
+
+  for (unsigned int i = 0; i < count; i++) rom_page_owner[page + i] = 0;
+  rom_map_pages[page] = 0;
+  unmap_rom_pages(page, count);
+  rom_images[owner - 1].refs--;
+  rom_image_release(owner - 1);
+}
+
+// SEG65 container: a 6 byte header followed by the segments back to back.
+//
+//   header   "SEG65" count:u8
+//   segment  addr:u16le len:u16le flags:u8 data[len]
+//
+// Segments with SEG_ROM set are mapped read-only out of the file itself and
+// must start and end on page boundaries; the rest are copied into memory.
+#define SEG_ROM 0x01
+
+int load_segments(const char *path) {
+  int index = rom_image_open(path);
+  if (index < 0) return -1;
+  const uint8_t *data = rom_images[index].data;
+  size_t size = rom_images[index].size;
+
+  if (size < 6 || memcmp(data, "SEG65", 5) != 0) {
+    rom_image_release(index);
+    return -1;
+  }
+
+  // validate every segment before touching memory, including that the ROM
+  // pages are free and not claimed twice, so committing can't fail halfway
+  uint8_t claimed[0x100] = {0};
+  size_t pos = 6;
+  for (int s = 0; s < data[5]; s++) {
+    if (pos + 5 > size) goto bad;
+    uint16_t addr = data[pos] | (data[pos + 1] << 8);
+    size_t len = data[pos + 2] | (data[pos + 3] << 8);
+    uint8_t flags = data[pos + 4];
+    pos += 5;
+    if (pos + len > size || addr + len > 0x10000) goto bad;
+    if (flags & SEG_ROM) {
+      if ((addr & U8_MAX) || (len & U8_MAX) || len == 0) goto bad;
+      for (size_t page = addr >> 8; page < (addr + len) >> 8; page++) {
+        if (rom_page_owner[page] || claimed[page]) goto bad;
+        claimed[page] = 1;
+      }
+    }
+    pos += len;
+  }
+
+  pos = 6;
+  for (int s = 0; s < data[5]; s++) {
+    uint16_t addr = data[pos] | (data[pos + 1] << 8);
+    size_t len = data[pos + 2] | (data[pos + 3] << 8);
+    uint8_t flags = data[pos + 4];
+    pos += 5;
+    if (flags & SEG_ROM) {
+      if (rom_map_range(index, pos, addr, len) != 0) goto bad;
+    } else {
+      memcpy(memory + addr, data + pos, len);
+    }
+    pos += len;
+  }
+
+  rom_image_release(index);
+  return 0;
+
+bad:
+  rom_image_release(index);
+  return -1;
+}
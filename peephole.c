@@ -0,0 +1,505 @@
+#include "assembler.c"
+
+// Peephole optimizer that runs between parse_program() and
+// assemble_program(). It rewrites the Program in place to cut cycles
+// without changing what the code does:
+//
+//   - absolute operands below $0100 become zero page (ABS only; indexed
+//     modes wrap differently in zero page so they are left alone)
+//   - loads, transfers and flag instructions whose result is already known
+//     are dropped, as are branches whose flag says they are never taken
+//   - "Bxx skip / JMP target / skip:" becomes one inverted short branch
+//     when target is in range, and jumps or branches to the very next
+//     instruction are dropped
+//
+// Register and flag values are only tracked inside a basic block; every
+// label is treated as a possible entry point. Branches, JMPs and JSRs
+// written with a number inside the program get a label of their own first
+// so they move with the code. Addresses the optimizer can't follow leave
+// the program where it is: a jump target inside an instruction, any other
+// numeric operand inside the program (self-modifying code, tables) and any
+// JMP (ind), whose vector may be built at run time. Code reached through
+// an address pushed for RTS has no such marker, so assemble it without the
+// optimizer. The passes only ever shrink the code, so they are repeated
+// until nothing changes.
+
+typedef struct {
+  uint16_t addr;      // start of the block in the optimized code
+  unsigned int line;  // source line of its first instruction
+  int cycles_saved;   // base cycles, each instruction counted once
+  int bytes_saved;
+} BlockSaving;
+
+typedef struct {
+  BlockSaving *blocks;
+  size_t capacity;
+  size_t size;
+  int cycles_saved;
+  int bytes_saved;
+} OptReport;
+
+#define UNKNOWN -1
+
+// What is known about the registers and flags at a point in a block.
+// nz is the value N and Z were last set from.
+typedef struct {
+  int16_t reg[3];  // A, X, Y
+  int16_t nz;
+  int8_t c, v, d, i;
+} known_state;
+
+enum { REG_A, REG_X, REG_Y };
+
+static void forget_all(known_state *s) {
+  s->reg[REG_A] = s->reg[REG_X] = s->reg[REG_Y] = UNKNOWN;
+  s->nz = UNKNOWN;
+  s->c = s->v = s->d = s->i = UNKNOWN;
+}
+
+// Would setting N and Z from value leave them as they already are?
+static int nz_same(int16_t nz, uint8_t value) {
+  return nz != UNKNOWN && (nz == 0) == (value == 0) && (nz & 0x80) == (value & 0x80);
+}
+
+static int instr_cycles(const Instr *in) {
+  if (in->kind != ITEM_INSTR) return 0;
+  return opcode_table[encode_table[in->op][in->mode]].cycles;
+}
+
+static int instr_bytes(const Instr *in) {
+  return in->kind == ITEM_INSTR ? mode_sizes[in->mode] : 0;
+}
+
+static int ends_block(uint8_t op) {
+  switch (op) {
+    case OP_BCC: case OP_BCS: case OP_BEQ: case OP_BMI: case OP_BNE:
+    case OP_BPL: case OP_BVC: case OP_BVS: case OP_BRK: case OP_JMP:
+    case OP_JSR: case OP_RTI: case OP_RTS:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static int resolve_operand(Program *prog, const Instr *in, uint16_t *value) {
+  if (!in->symbol) {
+    *value = in->value;
+    return 0;
+  }
+  return find_label(prog, in->symbol, value);
+}
+
+// Index of the next instruction after i, or prog->size. *labelled is set if
+// a label sits in between.
+static size_t next_instr(Program *prog, size_t i, int *labelled) {
+  *labelled = 0;
+  for (i++; i < prog->size; i++) {
+    if (prog->items[i].kind == ITEM_INSTR) break;
+    if (prog->items[i].kind == ITEM_LABEL) *labelled = 1;
+  }
+  return i;
+}
+
+// Is name one of the labels between item i and the next instruction?
+static int label_follows(Program *prog, size_t i, const char *name) {
+  if (!name) return 0;
+  for (i++; i < prog->size && prog->items[i].kind != ITEM_INSTR; i++)
+    if (prog->items[i].kind == ITEM_LABEL && strcmp(prog->items[i].symbol, name) == 0)
+      return 1;
+  return 0;
+}
+
+static int zero_page_operands(Program *prog) {
+  int changed = 0;
+  for (size_t i = 0; i < prog->size; i++) {
+    Instr *in = &prog->items[i];
+    uint16_t value;
+    if (in->kind != ITEM_INSTR || in->mode != MODE_ABS || encode_table[in->op][MODE_ZP] < 0)
+      continue;
+    if (resolve_operand(prog, in, &value) != 0 || value > U8_MAX) continue;
+    in->mode = MODE_ZP;
+    changed = 1;
+  }
+  return changed;
+}
+
+// Returns 1 if in can go because it would not change the known state.
+static int redundant(const known_state *s, const Instr *in) {
+  static const uint8_t load_reg[] = {[OP_LDA] = REG_A, [OP_LDX] = REG_X, [OP_LDY] = REG_Y};
+  int16_t from;
+  switch (in->op) {
+    case OP_LDA: case OP_LDX: case OP_LDY:
+      return in->mode == MODE_IMM && s->reg[load_reg[in->op]] == in->value &&
+             nz_same(s->nz, in->value);
+    case OP_TAX: case OP_TAY:
+      from = s->reg[REG_A];
+      return from != UNKNOWN && s->reg[in->op == OP_TAX ? REG_X : REG_Y] == from &&
+             nz_same(s->nz, from);
+    case OP_TXA: case OP_TYA:
+      from = s->reg[in->op == OP_TXA ? REG_X : REG_Y];
+      return from != UNKNOWN && s->reg[REG_A] == from && nz_same(s->nz, from);
+    case OP_CLC: return s->c == 0;
+    case OP_SEC: return s->c == 1;
+    case OP_CLV: return s->v == 0;
+    case OP_CLD: return s->d == 0;
+    case OP_SED: return s->d == 1;
+    case OP_CLI: return s->i == 0;
+    case OP_SEI: return s->i == 1;
+    // branches that can never be taken
+    case OP_BCC: return s->c == 1;
+    case OP_BCS: return s->c == 0;
+    case OP_BVC: return s->v == 1;
+    case OP_BVS: return s->v == 0;
+    case OP_BEQ: return s->nz != UNKNOWN && s->nz != 0;
+    case OP_BNE: return s->nz == 0;
+    case OP_BMI: return s->nz != UNKNOWN && !(s->nz & 0x80);
+    case OP_BPL: return s->nz != UNKNOWN && (s->nz & 0x80);
+    default:
+      return 0;
+  }
+}
+
+static void set_reg(known_state *s, int reg, int16_t value) {
+  s->reg[reg] = value;
+  s->nz = value;
+}
+
+static int16_t step_value(int16_t value, int delta) {
+  return value == UNKNOWN ? UNKNOWN : (value + delta) & U8_MAX;
+}
+
+// Applies the effect of in to what is known.
+static void track(known_state *s, const Instr *in) {
+  int imm = in->mode == MODE_IMM;
+  int16_t a = s->reg[REG_A];
+  switch (in->op) {
+    case OP_LDA: set_reg(s, REG_A, imm ? in->value : UNKNOWN); break;
+    case OP_LDX: set_reg(s, REG_X, imm ? in->value : UNKNOWN); break;
+    case OP_LDY: set_reg(s, REG_Y, imm ? in->value : UNKNOWN); break;
+    case OP_TAX: set_reg(s, REG_X, a); break;
+    case OP_TAY: set_reg(s, REG_Y, a); break;
+    case OP_TXA: set_reg(s, REG_A, s->reg[REG_X]); break;
+    case OP_TYA: set_reg(s, REG_A, s->reg[REG_Y]); break;
+    case OP_TSX: set_reg(s, REG_X, UNKNOWN); break;
+    case OP_INX: set_reg(s, REG_X, step_value(s->reg[REG_X], 1)); break;
+    case OP_DEX: set_reg(s, REG_X, step_value(s->reg[REG_X], -1)); break;
+    case OP_INY: set_reg(s, REG_Y, step_value(s->reg[REG_Y], 1)); break;
+    case OP_DEY: set_reg(s, REG_Y, step_value(s->reg[REG_Y], -1)); break;
+    case OP_AND: set_reg(s, REG_A, imm && a != UNKNOWN ? a & in->value : UNKNOWN); break;
+    case OP_ORA: set_reg(s, REG_A, imm && a != UNKNOWN ? a | in->value : UNKNOWN); break;
+    case OP_EOR: set_reg(s, REG_A, imm && a != UNKNOWN ? a ^ in->value : UNKNOWN); break;
+    case OP_PLA: set_reg(s, REG_A, UNKNOWN); break;
+    case OP_ADC: case OP_SBC:
+      set_reg(s, REG_A, UNKNOWN);
+      s->c = s->v = UNKNOWN;
+      break;
+    case OP_ASL: case OP_LSR: case OP_ROL: case OP_ROR:
+      if (in->mode == MODE_ACC) s->reg[REG_A] = UNKNOWN;
+      s->nz = s->c = UNKNOWN;
+      break;
+    case OP_CMP: case OP_CPX: case OP_CPY:
+      s->nz = s->c = UNKNOWN;
+      break;
+    case OP_BIT:
+      s->nz = s->v = UNKNOWN;
+      break;
+    case OP_INC: case OP_DEC:
+      s->nz = UNKNOWN;
+      break;
+    case OP_CLC: s->c = 0; break;
+    case OP_SEC: s->c = 1; break;
+    case OP_CLV: s->v = 0; break;
+    case OP_CLD: s->d = 0; break;
+    case OP_SED: s->d = 1; break;
+    case OP_CLI: s->i = 0; break;
+    case OP_SEI: s->i = 1; break;
+    case OP_PLP:
+      s->nz = UNKNOWN;
+      s->c = s->v = s->d = s->i = UNKNOWN;
+      break;
+    // falling through a branch tells us the flag it tested
+    case OP_BCC: s->c = 1; break;
+    case OP_BCS: s->c = 0; break;
+    case OP_BVC: s->v = 1; break;
+    case OP_BVS: s->v = 0; break;
+    case OP_BEQ: case OP_BNE: case OP_BMI: case OP_BPL:
+      break;
+    case OP_BRK: case OP_JMP: case OP_JSR: case OP_RTI: case OP_RTS:
+      forget_all(s);
+      break;
+    default: // NOP, PHA, PHP, TXS and stores
+      break;
+  }
+}
+
+static int drop_redundant(Program *prog) {
+  int changed = 0;
+  known_state s;
+  forget_all(&s);
+  for (size_t i = 0; i < prog->size; i++) {
+    Instr *in = &prog->items[i];
+    if (in->kind == ITEM_LABEL) forget_all(&s);
+    if (in->kind != ITEM_INSTR) continue;
+    if (redundant(&s, in)) {
+      in->kind = ITEM_REMOVED;
+      changed = 1;
+      continue;
+    }
+    track(&s, in);
+  }
+  return changed;
+}
+
+static uint8_t invert_branch(uint8_t op) {
+  switch (op) {
+    case OP_BCC: return OP_BCS;
+    case OP_BCS: return OP_BCC;
+    case OP_BEQ: return OP_BNE;
+    case OP_BNE: return OP_BEQ;
+    case OP_BMI: return OP_BPL;
+    case OP_BPL: return OP_BMI;
+    case OP_BVC: return OP_BVS;
+    default:     return OP_BVC;
+  }
+}
+
+static int short_branches(Program *prog) {
+  int changed = 0;
+  for (size_t i = 0; i < prog->size; i++) {
+    Instr *in = &prog->items[i];
+    if (in->kind != ITEM_INSTR) continue;
+
+    // jumping or branching to the next instruction does nothing
+    if ((in->mode == MODE_REL || (in->op == OP_JMP && in->mode == MODE_ABS)) &&
+        label_follows(prog, i, in->symbol)) {
+      in->kind = ITEM_REMOVED;
+      changed = 1;
+      continue;
+    }
+
+    int labelled;
+    size_t j = next_instr(prog, i, &labelled);
+    if (in->mode != MODE_REL || j >= prog->size || labelled) continue;
+    Instr *jmp = &prog->items[j];
+    uint16_t target;
+    if (jmp->op != OP_JMP || jmp->mode != MODE_ABS || !label_follows(prog, j, in->symbol) ||
+        resolve_operand(prog, jmp, &target) != 0)
+      continue;
+    // the layout is from before this change, which only brings the target closer
+    int offset = target - (in->addr + 2);
+    if (offset < -128 || offset > 127) continue;
+
+    free(in->symbol);
+    in->op = invert_branch(in->op);
+    in->symbol = jmp->symbol;
+    in->value = jmp->value;
+    jmp->symbol = NULL;
+    jmp->kind = ITEM_REMOVED;
+    changed = 1;
+  }
+  return changed;
+}
+
+static void insert_label(Program *prog, size_t at, const char *name, uint16_t addr,
+                         unsigned int line) {
+  program_push(prog, (Instr){0});
+  memmove(&prog->items[at + 1], &prog->items[at], (prog->size - 1 - at) * sizeof(Instr));
+  prog->items[at] = (Instr){ITEM_LABEL, 0, 0, 0, strdup(name), addr, line};
+}
+
+// Gives every numeric branch, JMP or JSR target between origin and the end
+// of the program a made-up label in front of the instruction it names, and
+// points the operand at it. The names start with '$', which no source label
+// can. Returns -1 if the code can't be moved safely: a target lands inside
+// an instruction, another numeric operand points into the program or there
+// is a JMP (ind).
+static int anchor_numeric_targets(Program *prog, uint16_t origin) {
+  uint32_t end = layout_program(prog, origin);
+  for (size_t i = 0; i < prog->size; i++) {
+    Instr *in = &prog->items[i];
+    if (in->kind != ITEM_INSTR) continue;
+    if (in->op == OP_JMP && in->mode == MODE_IND) return -1;
+    int jump = (in->op == OP_JMP || in->op == OP_JSR) && in->mode == MODE_ABS;
+    if (in->symbol || in->mode == MODE_IMP || in->mode == MODE_ACC ||
+        in->mode == MODE_IMM || in->value < origin || in->value > end)
+      continue;
+    if (in->mode != MODE_REL && !jump) return -1;
+
+    uint16_t target = in->value, unused;
+    unsigned int line = in->line;
+    char name[8];
+    snprintf(name, sizeof name, "$%04X", target);
+    if (find_label(prog, name, &unused) != 0) {
+      size_t at = 0;
+      while (at < prog->size &&
+             (prog->items[at].kind != ITEM_INSTR || prog->items[at].addr < target))
+        at++;
+      if (at < prog->size ? prog->items[at].addr != target : target != end) return -1;
+      insert_label(prog, at, name, target, line);
+      if (at <= i) i++;
+    }
+    prog->items[i].symbol = strdup(name);
+  }
+  return 0;
+}
+
+static void report_push(OptReport *report, BlockSaving block) {
+  if (report->size >= report->capacity) {
+    report->capacity = (report->capacity == 0 ? 8 : report->capacity * 2);
+    report->blocks = realloc(report->blocks, report->capacity * sizeof(BlockSaving));
+    assert(report->blocks);
+  }
+  report->blocks[report->size++] = block;
+}
+
+void opt_report_free(OptReport *report) {
+  free(report->blocks);
+  report->blocks = NULL;
+  report->size = report->capacity = 0;
+}
+
+// Optimizes prog as laid out from origin. If report isn't NULL it receives
+// the cycles and bytes saved in each basic block of the result. Undefined
+// labels are left for assemble_program() to report.
+void peephole(Program *prog, uint16_t origin, OptReport *report) {
+  init_encode_table();
+  int movable = (anchor_numeric_targets(prog, origin) == 0);
+  int *before_cycles = malloc(sizeof(int) * (prog->size + 1));
+  int *before_bytes = malloc(sizeof(int) * (prog->size + 1));
+  assert(before_cycles && before_bytes);
+  for (size_t i = 0; i < prog->size; i++) {
+    before_cycles[i] = instr_cycles(&prog->items[i]);
+    before_bytes[i] = instr_bytes(&prog->items[i]);
+  }
+
+  int changed = movable;
+  while (changed) {
+    layout_program(prog, origin);
+    changed = zero_page_operands(prog);
+    changed |= drop_redundant(prog);
+    layout_program(prog, origin);
+    changed |= short_branches(prog);
+  }
+  layout_program(prog, origin);
+
+  if (report) {
+    *report = (OptReport){NULL, 0, 0, 0, 0};
+    int new_block = 1;
+    for (size_t i = 0; i < prog->size; i++) {
+      Instr *in = &prog->items[i];
+      if (in->kind == ITEM_LABEL) {
+        new_block = 1;
+        continue;
+      }
+      if (new_block) {
+        report_push(report, (BlockSaving){in->addr, in->line, 0, 0});
+        new_block = 0;
+      }
+      BlockSaving *block = &report->blocks[report->size - 1];
+      block->cycles_saved += before_cycles[i] - instr_cycles(in);
+      block->bytes_saved += before_bytes[i] - instr_bytes(in);
+      if (in->kind == ITEM_INSTR && ends_block(in->op)) new_block = 1;
+    }
+    for (size_t b = 0; b < report->size; b++) {
+      report->cycles_saved += report->blocks[b].cycles_saved;
+      report->bytes_saved += report->blocks[b].bytes_saved;
+    }
+  }
+  free(before_cycles);
+  free(before_bytes);
+}
+
+void opt_report_print(FILE *f, const OptReport *report) {
+  fprintf(f, "%-6s %6s %8s %8s\n", "block", "line", "cycles", "bytes");
+  for (size_t b = 0; b < report->size; b++) {
+    const BlockSaving *block = &report->blocks[b];
+    fprintf(f, "$%04X  %6u %8d %8d\n", block->addr, block->line,
+            block->cycles_saved, block->bytes_saved);
+  }
+  fprintf(f, "total  %6s %8d %8d\n", "", report->cycles_saved, report->bytes_saved);
+}
+
+// assemble() with the optimizer in between; report may be NULL.
+int assemble_optimized(const char *src, uint16_t origin, uint8_t *out, size_t *len,
+                       OptReport *report) {
+  Token tok = tokenize_all(src);
+  Program prog;
+  program_init(&prog, 64);
+  int result = parse_program(&tok, &prog);
+  if (result == 0) {
+    peephole(&prog, origin, report);
+    result = assemble_program(&prog, origin, out, len);
+  }
+  program_free(&prog);
+  token_free(&tok);
+  return result;
+}
+
+static void verify_run(const uint8_t *image, size_t len, uint16_t origin, uint64_t max_steps) {
+  reset_cpu();
+  memcpy(memory + origin, image, len);
+  default_cpu.PC = origin;
+  default_cpu.cycles = 0;
+  run(max_steps);
+}
+
+// Assembles src from origin as written into plain and through the optimizer
+// into optimized, each with room for 64K. Nothing here touches memory, so
+// callers can build on several threads and share only the runs. Returns 0,
+// or -1 if src doesn't assemble.
+int peephole_build(const char *src, uint16_t origin, uint8_t *plain, size_t *plain_len,
+                   uint8_t *optimized, size_t *optimized_len) {
+  // one parse serves both builds: assemble, optimize, assemble again
+  Token tok = tokenize_all(src);
+  Program prog;
+  program_init(&prog, 64);
+  int result = parse_program(&tok, &prog);
+  if (result == 0) result = assemble_program(&prog, origin, plain, plain_len);
+  if (result == 0) {
+    peephole(&prog, origin, NULL);
+    result = assemble_program(&prog, origin, optimized, optimized_len);
+  }
+  program_free(&prog);
+  token_free(&tok);
+  return result == 0 ? 0 : -1;
+}
+
+// Runs the two builds from peephole_build() from origin on a freshly reset
+// machine, for at most max_steps instructions each. Both must stop the same
+// way with the same registers, flags and memory; the code itself and the
+// stack below SP, where stale return addresses live, are not compared. The
+// cycle counts of the two runs go to *before and *after. Returns 0 if the
+// runs agree, -1 otherwise. This uses default_cpu and overwrites memory.
+int peephole_compare(const uint8_t *plain, size_t plain_len, const uint8_t *optimized,
+                     size_t optimized_len, uint16_t origin, uint64_t max_steps,
+                     uint64_t *before, uint64_t *after) {
+  static uint8_t expected[0x10000];
+  verify_run(plain, plain_len, origin, max_steps);
+  cpu6502 want = default_cpu;
+  memcpy(expected, memory, sizeof expected);
+  verify_run(optimized, optimized_len, origin, max_steps);
+  cpu6502 got = default_cpu;
+  *before = want.cycles;
+  *after = got.cycles;
+
+  if (want.stop == STOP_NONE || got.stop != want.stop || got.A != want.A ||
+      got.X != want.X || got.Y != want.Y || got.SP != want.SP ||
+      status_to_byte_c(got.P) != status_to_byte_c(want.P))
+    return -1;
+  // copy the parts that may differ across so one memcmp covers the rest
+  size_t code_len = plain_len < 0x10000u - origin ? plain_len : 0x10000u - origin;
+  memcpy(memory + origin, expected + origin, code_len);
+  memcpy(memory + 0x100, expected + 0x100, want.SP + 1);
+  return memcmp(memory, expected, sizeof expected) == 0 ? 0 : -1;
+}
+
+// Checks the optimizer on src: peephole_build() and then peephole_compare().
+int peephole_verify(const char *src, uint16_t origin, uint64_t max_steps,
+                    uint64_t *before, uint64_t *after) {
+  static uint8_t plain[0x10000], optimized[0x10000];
+  size_t plain_len, optimized_len;
+  if (peephole_build(src, origin, plain, &plain_len, optimized, &optimized_len) != 0)
+    return -1;
+  return peephole_compare(plain, plain_len, optimized, optimized_len, origin, max_steps,
+                          before, after);
+}
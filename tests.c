@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include "cpu.c"
+#include "loader.c"
+#include "assembler.c"
+#include "peephole.c"
+#include "devices.c"
 
 static int total_tests = 0;
 static int passed_tests = 0;
@@ -33,6 +37,52 @@ static int flags_equal(uint8_t C, uint8_t Z, uint8_t I, uint8_t D,
           default_cpu.P.N == N);
 }
 
+// Test device: reads return the cycle they happen on, one byte per
+// register, writes are logged, a write to register 2 raises an IRQ as soon
+// as the device's lead allows and one to register 3 starts a timer that
+// raises one value * 256 cycles later.
+typedef struct {
+  uint64_t last_cycle;
+  uint64_t irq_due;
+  uint64_t read_cycle;
+  int out_of_order;
+  int writes;
+  uint8_t values[64];
+  uint64_t cycles[64];
+} clock_device;
+
+static void clock_advance(device *dev, uint64_t cycle) {
+  clock_device *c = dev->data;
+  if (cycle < c->last_cycle) c->out_of_order = 1;
+  c->last_cycle = cycle;
+}
+
+static void clock_write(device *dev, uint16_t reg, uint8_t value, uint64_t cycle) {
+  clock_device *c = dev->data;
+  if (c->writes < 64) {
+    c->values[c->writes] = value;
+    c->cycles[c->writes] = cycle;
+  }
+  c->writes++;
+  if (reg == 2) device_irq(dev, cycle);
+  if (reg == 3) device_irq(dev, c->irq_due = cycle + value * 256u);
+}
+
+static uint8_t clock_read(device *dev, uint16_t reg, uint64_t cycle) {
+  clock_device *c = dev->data;
+  c->read_cycle = cycle;
+  return cycle >> (8 * reg);
+}
+
+static const char *write_temp(const char *name, const void *data, size_t len) {
+  static char path[256];
+  snprintf(path, sizeof path, "/tmp/6502-test-%d-%s", (int)getpid(), name);
+  FILE *f = fopen(path, "wb");
+  fwrite(data, 1, len, f);
+  fclose(f);
+  return path;
+}
+
 int main(void) {
   printf("Starting 6502 CPU test suite...\n\n");
 
@@ -199,6 +249,445 @@ int main(void) {
                   memory[0x202] == 0x56);
   END_TEST(ok_store);
 
+  // ----------------------------------------------------------
+  BEGIN_TEST("run executes a program until BRK");
+  reset_cpu();
+  {
+    // LDA #$05; CLC; ADC #$03; STA $0200; BRK
+    uint8_t prog[] = {0xA9, 0x05, 0x18, 0x69, 0x03, 0x8D, 0x00, 0x02, 0x00};
+    for (unsigned i = 0; i < sizeof prog; i++) memory[0x0600 + i] = prog[i];
+  }
+  default_cpu.PC = 0x0600;
+  uint64_t ran = run(100);
+  int ok_run = (ran == 5 && default_cpu.stop == STOP_BRK &&
+                memory[0x200] == 0x08 && default_cpu.cycles == 17);
+  END_TEST(ok_run);
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("run takes backward branches");
+  reset_cpu();
+  {
+    // LDX #$05; loop: DEX; BNE loop; BRK
+    uint8_t prog[] = {0xA2, 0x05, 0xCA, 0xD0, 0xFD, 0x00};
+    for (unsigned i = 0; i < sizeof prog; i++) memory[0x0600 + i] = prog[i];
+  }
+  default_cpu.PC = 0x0600;
+  ran = run(100);
+  int ok_loop = (ran == 12 && default_cpu.X == 0 &&
+                 default_cpu.stop == STOP_BRK);
+  END_TEST(ok_loop);
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("Breakpoints stop run and resume");
+  reset_cpu();
+  {
+    // LDX #$05; loop: DEX; BNE loop; BRK
+    uint8_t prog[] = {0xA2, 0x05, 0xCA, 0xD0, 0xFD, 0x00};
+    for (unsigned i = 0; i < sizeof prog; i++) memory[0x0600 + i] = prog[i];
+  }
+  default_cpu.PC = 0x0600;
+  set_breakpoint(0x0602);
+  ran = run(100);
+  int ok_break = (ran == 1 && default_cpu.stop == STOP_BREAKPOINT &&
+                  default_cpu.PC == 0x0602 && default_cpu.X == 5);
+  ran = run(100);
+  ok_break &= (default_cpu.stop == STOP_BREAKPOINT && default_cpu.X == 4);
+  clear_breakpoint(0x0602);
+  run(100);
+  ok_break &= (default_cpu.stop == STOP_BRK && default_cpu.X == 0);
+  END_TEST(ok_break);
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("Watchpoints catch stores and stack traffic");
+  reset_cpu();
+  set_watchpoint(0x0200, WATCH_WRITE);
+  STX(0x0201);
+  int ok_watch = (default_cpu.stop == STOP_NONE);
+  STA(0x0200);
+  ok_watch &= (default_cpu.stop == STOP_WATCH_WRITE && watch_hit_addr == 0x200);
+  default_cpu.stop = STOP_NONE;
+  set_watchpoint(0x01FF, WATCH_READ);
+  PHA();
+  ok_watch &= (default_cpu.stop == STOP_NONE);
+  PLA();
+  ok_watch &= (default_cpu.stop == STOP_WATCH_READ && watch_hit_addr == 0x1FF);
+  clear_all_debug();
+  ok_watch &= (page_flags[0x01] == 0 && page_flags[0x02] == 0);
+  END_TEST(ok_watch);
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("load_raw copies a binary to its base");
+  reset_cpu();
+  {
+    uint8_t bin[] = {0xA9, 0x42, 0x00};
+    const char *path = write_temp("raw.bin", bin, sizeof bin);
+    int ok_raw = (load_raw(path, 0x0600) == 0 && memory[0x0600] == 0xA9 &&
+                  memory[0x0601] == 0x42 && memory[0x0603] == 0x00);
+    memory[0xFFFF] = 0x5A;
+    ok_raw &= (load_raw(path, 0xFFFF) == -1 && memory[0xFFFF] == 0x5A);
+    unlink(path);
+    END_TEST(ok_raw);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("load_ihex checks records and checksums");
+  reset_cpu();
+  {
+    const char *good = ":03060000A942000C\n:00000001FF\n";
+    const char *bad  = ":03061000A94200FD\n:00000001FF\n";
+    const char *path = write_temp("good.hex", good, strlen(good));
+    int ok_hex = (load_ihex(path) == 0 && memory[0x0600] == 0xA9 &&
+                  memory[0x0601] == 0x42 && memory[0x0602] == 0x00);
+    unlink(path);
+    path = write_temp("bad.hex", bad, strlen(bad));
+    ok_hex &= (load_ihex(path) == -1 && memory[0x0610] == 0x00);
+    unlink(path);
+    END_TEST(ok_hex);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("map_rom shares read-only pages");
+  reset_cpu();
+  {
+    static uint8_t rom[0x200];
+    // $F000: LDA $F100; STA $F100; STA $0200; BRK
+    uint8_t code[] = {0xAD, 0x00, 0xF1, 0x8D, 0x00, 0xF1, 0x8D, 0x00, 0x02, 0x00};
+    memcpy(rom, code, sizeof code);
+    rom[0x100] = 0x77;
+    const char *path = write_temp("rom.bin", rom, sizeof rom);
+    int ok_rom = (map_rom(path, 0xF000) == 0 && map_rom(path, 0xE000) == 0);
+    ok_rom &= (read_pages[0xF0] == read_pages[0xE0] &&
+               rom_images[rom_page_owner[0xF0] - 1].refs == 2);
+    default_cpu.PC = 0xF000;
+    run(10);
+    ok_rom &= (default_cpu.stop == STOP_BRK && memory[0x0200] == 0x77 &&
+               read_mem(0xF100) == 0x77 && memory[0xF100] == 0x00);
+    ok_rom &= (map_rom(path, 0xF100) == -1 && map_rom(path, 0xF080) == -1);
+    // a mapping right after another of the same image stays its own
+    ok_rom &= (map_rom(path, 0xE200) == 0 && rom_images[rom_page_owner[0xE2] - 1].refs == 3);
+    unmap_rom(0xE000);
+    ok_rom &= (page_flags[0xE0] == 0 && (page_flags[0xE2] & PAGE_ROM) &&
+               read_pages[0xE3] == read_pages[0xF1] && rom_images[0].refs == 2);
+    unmap_rom(0xE100); // not the start of a mapping
+    ok_rom &= ((page_flags[0xE2] & PAGE_ROM) && rom_images[0].refs == 2);
+    unmap_rom(0xF000);
+    unmap_rom(0xE200);
+    ok_rom &= (page_flags[0xF0] == 0 && page_flags[0xE2] == 0 &&
+               read_pages[0xF1] == memory + 0xF100 &&
+               rom_images[0].refs == 0 && rom_images[0].data == NULL);
+    unlink(path);
+    END_TEST(ok_rom);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("load_segments copies RAM and maps ROM");
+  reset_cpu();
+  {
+    static uint8_t seg[6 + 5 + 2 + 5 + 0x100];
+    memcpy(seg, "SEG65", 5);
+    seg[5] = 2;
+    uint8_t ram_hdr[] = {0x00, 0x06, 0x02, 0x00, 0x00, 0x11, 0x22};
+    uint8_t rom_hdr[] = {0x00, 0xC0, 0x00, 0x01, SEG_ROM};
+    memcpy(seg + 6, ram_hdr, sizeof ram_hdr);
+    memcpy(seg + 13, rom_hdr, sizeof rom_hdr);
+    seg[18] = 0x99;
+    const char *path = write_temp("seg.bin", seg, sizeof seg);
+    int ok_seg = (load_segments(path) == 0 && memory[0x0600] == 0x11 &&
+                  memory[0x0601] == 0x22 && read_mem(0xC000) == 0x99 &&
+                  (page_flags[0xC0] & PAGE_ROM));
+    unmap_rom(0xC000);
+    seg[5] = 3;
+    unlink(path);
+    path = write_temp("seg.bin", seg, sizeof seg);
+    ok_seg &= (load_segments(path) == -1);
+    unlink(path);
+
+    // a second ROM segment over the same page fails before anything is applied
+    static uint8_t twice[sizeof seg + 5 + 0x100];
+    memcpy(twice, seg, sizeof seg);
+    twice[5] = 3;
+    memcpy(twice + sizeof seg, rom_hdr, sizeof rom_hdr);
+    memory[0x0600] = 0;
+    path = write_temp("seg.bin", twice, sizeof twice);
+    ok_seg &= (load_segments(path) == -1 && memory[0x0600] == 0 &&
+               !(page_flags[0xC0] & PAGE_ROM));
+    for (int i = 0; i < ROM_IMAGES_MAX; i++) ok_seg &= (rom_images[i].refs == 0);
+    unlink(path);
+
+    // on the next page instead, the two are separate mappings
+    twice[sizeof seg + 1] = 0xC1;
+    path = write_temp("seg.bin", twice, sizeof twice);
+    ok_seg &= (load_segments(path) == 0 && (page_flags[0xC1] & PAGE_ROM) &&
+               rom_images[rom_page_owner[0xC0] - 1].refs == 2);
+    unmap_rom(0xC000);
+    ok_seg &= (!(page_flags[0xC0] & PAGE_ROM) && (page_flags[0xC1] & PAGE_ROM));
+    unmap_rom(0xC100);
+    ok_seg &= !(page_flags[0xC1] & PAGE_ROM);
+    for (int i = 0; i < ROM_IMAGES_MAX; i++) ok_seg &= (rom_images[i].refs == 0);
+    unlink(path);
+    END_TEST(ok_seg);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("assemble encodes modes and labels");
+  {
+    static uint8_t out[0x10000];
+    size_t len = 0;
+    const char *src =
+        "start: LDX #$05 ; count\n"
+        "loop:  DEX\n"
+        "       BNE loop\n"
+        "       LDA ($10),Y\n"
+        "       STA $0010\n"
+        "       LDA $10,Y\n"
+        "       ROL A\n"
+        "       JSR start\n";
+    uint8_t expected[] = {0xA2, 0x05, 0xCA, 0xD0, 0xFD, 0xB1, 0x10, 0x8D, 0x10,
+                          0x00, 0xB9, 0x10, 0x00, 0x2A, 0x20, 0x00, 0x06};
+    int ok_asm = (assemble(src, 0x0600, out, &len) == 0 &&
+                  len == sizeof expected && memcmp(out, expected, len) == 0);
+    ok_asm &= (assemble("JMP nowhere\n", 0x0600, out, &len) == -1);
+    ok_asm &= (assemble("LDX $10,X\n", 0x0600, out, &len) == -1);
+    END_TEST(ok_asm);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("peephole shortens code and reports it");
+  {
+    static uint8_t out[0x10000];
+    size_t len = 0;
+    OptReport report;
+    const char *src =
+        "       LDA $0010\n"   // zero page
+        "       CLC\n"
+        "       CLC\n"         // carry already clear
+        "       LDX #$00\n"
+        "       LDA #$00\n"
+        "       TXA\n"         // A is already 0 and Z set from it
+        "       BCS done\n"    // never taken
+        "       INC $0020\n"   // zero page
+        "       BNE skip\n"
+        "       JMP done\n"    // folded into BEQ done
+        "skip:  INX\n"
+        "       JMP done\n"    // jumps to the next instruction
+        "done:  BRK\n";
+    uint8_t expected[] = {0xA5, 0x10, 0x18, 0xA2, 0x00, 0xA9, 0x00,
+                          0xE6, 0x20, 0xF0, 0x01, 0xE8, 0x00};
+    int ok_opt = (assemble_optimized(src, 0x0600, out, &len, &report) == 0 &&
+                  len == sizeof expected && memcmp(out, expected, len) == 0);
+    ok_opt &= (report.cycles_saved == 14 && report.bytes_saved == 12);
+    // the first block keeps 8 of those, each JMP accounts for 3 in its own
+    ok_opt &= (report.size == 4 && report.blocks[0].addr == 0x0600 &&
+               report.blocks[0].cycles_saved == 8 && report.blocks[2].cycles_saved == 3 &&
+               report.blocks[3].addr == 0x060C);
+    opt_report_free(&report);
+
+    // numeric targets move with the code, or stop it moving
+    uint64_t before, after;
+    ok_opt &= (peephole_verify("LDA #$01\nCLC\nCLC\nJMP $0608\nBRK\n"
+                               "LDA #$02\nSTA $0300\nBRK\n",
+                               0x0600, 100, &before, &after) == 0 &&
+               memory[0x0300] == 0x02 && after < before);
+    ok_opt &= (peephole_verify("CLC\nCLC\nJMP $0604\nBRK\nBRK\n",
+                               0x0600, 100, &before, &after) == 0 && after == before);
+    // so do data operands inside the program and jumps through a vector
+    ok_opt &= (peephole_verify("LDA #$42\nSTA $0608\nCLC\nCLC\nLDA #$00\n"
+                               "STA $0300\nBRK\n",
+                               0x0600, 100, &before, &after) == 0 &&
+               memory[0x0300] == 0x42 && after == before);
+    ok_opt &= (peephole_verify("LDA #$0F\nSTA $10\nLDA #$06\nSTA $11\nCLC\nCLC\n"
+                               "JMP ($0010)\nBRK\nBRK\nLDA #$02\nSTA $0300\nBRK\n",
+                               0x0600, 100, &before, &after) == 0 &&
+               memory[0x0300] == 0x02 && after == before);
+    END_TEST(ok_opt);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("peephole keeps the bench programs' results");
+  {
+    static const char *paths[] = {"bench/functional.s", "bench/sieve.s",
+                                  "bench/memcpy.s", "bench/bcd.s", "bench/sort.s"};
+    int ok_verify = 1;
+    for (size_t i = 0; i < sizeof paths / sizeof paths[0]; i++) {
+      uint8_t *text;
+      size_t size;
+      uint64_t before, after;
+      if (read_whole_file(paths[i], &text, &size) != 0) {
+        ok_verify = 0;
+        continue;
+      }
+      ok_verify &= (peephole_verify((char *)text, 0x0600, 100000000, &before, &after) == 0 &&
+                    after <= before);
+      free(text);
+    }
+    END_TEST(ok_verify);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("devices get writes and answer reads in CPU time");
+  {
+    static clock_device state;
+    static device clock = {"clock", clock_advance, clock_write, clock_read, &state};
+    static uint8_t out[0x10000];
+    size_t len;
+    reset_cpu();
+    default_cpu.cycles = 0;
+    // 20 writes, each followed by a read of the low byte of the cycle count
+    assemble("       LDX #20\n"
+             "loop:  STX $D000\n"
+             "       LDA $D000\n"
+             "       STA $0200,X\n"
+             "       DEX\n"
+             "       BNE loop\n"
+             "       LDA $D001\n"
+             "       STA $0300\n"
+             "       BRK\n", 0x0600, out, &len);
+    memcpy(memory + 0x0600, out, len);
+    default_cpu.PC = 0x0600;
+    set_device_lag(100);
+    int ok_dev = (attach_device(&clock, 0xD000, 4) == 0);
+    ok_dev &= (attach_device(&clock, 0xD002, 4) == -1);
+    run_devices(1000);
+    uint64_t end_cycles = default_cpu.cycles;
+    detach_devices();
+    set_device_lag(DEVICE_LAG_CYCLES);
+
+    // the first STX ends on cycle 6, the LDA after it on 10
+#ifdef CPU_FAST
+    const int loop_cycles = 17;
+#else
+    const int loop_cycles = 18; // taken BNE
+#endif
+    ok_dev &= (default_cpu.stop == STOP_BRK && state.writes == 20 && !state.out_of_order);
+    for (int i = 0; i < 20 && ok_dev; i++)
+      ok_dev &= (state.values[i] == 20 - i &&
+                 state.cycles[i] == 6 + (uint64_t)loop_cycles * i &&
+                 memory[0x0200 + 20 - i] == ((10 + loop_cycles * i) & U8_MAX));
+    ok_dev &= (memory[0x0300] == (end_cycles - 10) >> 8 && state.last_cycle == end_cycles);
+    // with the devices gone the page is memory again
+    write_mem(0xD000, 0x42);
+    ok_dev &= (read_mem(0xD000) == 0x42);
+    END_TEST(ok_dev);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("devices raise interrupt requests");
+  {
+    static clock_device state;
+    static device clock = {"clock", clock_advance, clock_write, clock_read, &state, 1, 256};
+    static uint8_t out[0x10000];
+    size_t len;
+    reset_cpu();
+    assemble("       CLI\n"
+             "       STA $D002\n"   // requests an IRQ
+             "wait:  LDA $20\n"
+             "       BEQ wait\n"
+             "       BRK\n", 0x0600, out, &len);
+    memcpy(memory + 0x0600, out, len);
+    assemble("       INC $20\n"
+             "       RTI\n", 0x0700, out, &len);
+    memcpy(memory + 0x0700, out, len);
+    memory[0xFFFE] = 0x00;
+    memory[0xFFFF] = 0x07;
+    default_cpu.PC = 0x0600;
+    int ok_irq = (attach_device(&clock, 0xD000, 4) == 0);
+    run_devices(10000000);
+    detach_devices();
+    ok_irq &= (default_cpu.stop == STOP_BRK && memory[0x20] == 1 &&
+               default_cpu.P.I == 0 && default_cpu.SP == 0xFF);
+    END_TEST(ok_irq);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("a masked device interrupt doesn't slow the CPU down");
+  {
+    static clock_device state;
+    static device clock = {"clock", clock_advance, clock_write, clock_read, &state, 1, 256};
+    static uint8_t out[0x10000];
+    size_t len;
+    reset_cpu();
+    memset(&state, 0, sizeof state);
+    // half a million instructions with a request held back by I, taken
+    // right after the CLI
+    assemble("       SEI\n"
+             "       STA $D002\n"
+             "       LDY #$00\n"
+             "       LDX #$00\n"
+             "loop:  NOP\n"
+             "       NOP\n"
+             "       NOP\n"
+             "       NOP\n"
+             "       NOP\n"
+             "       NOP\n"
+             "       DEX\n"
+             "       BNE loop\n"
+             "       DEY\n"
+             "       BNE loop\n"
+             "       CLI\n"
+             "       BRK\n", 0x0600, out, &len);
+    memcpy(memory + 0x0600, out, len);
+    uint16_t brk = 0x0600 + len - 1;
+    assemble("       INC $20\n"
+             "       RTI\n", 0x0700, out, &len);
+    memcpy(memory + 0x0700, out, len);
+    memory[0xFFFE] = 0x00;
+    memory[0xFFFF] = 0x07;
+    default_cpu.PC = 0x0600;
+    int ok_masked = (attach_device(&clock, 0xD000, 4) == 0);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    run_devices(10000000);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    detach_devices();
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    // the handler returned to the BRK after the CLI
+    ok_masked &= (default_cpu.stop == STOP_BRK && memory[0x20] == 1 &&
+                  memory[0x1FE] == (brk & U8_MAX) && memory[0x1FF] == brk >> 8 && secs < 0.25);
+    END_TEST(ok_masked);
+  }
+
+  // ----------------------------------------------------------
+  BEGIN_TEST("device interrupts land on their cycle whatever the lag");
+  {
+    static clock_device state;
+    static device clock = {"clock", clock_advance, clock_write, clock_read, &state, 1, 256};
+    static uint8_t out[0x10000];
+    static const uint64_t lags[] = {1, 100, DEVICE_LAG_CYCLES};
+    size_t len;
+    int ok_time = 1;
+    uint64_t first = 0;
+    for (int i = 0; i < 3; i++) {
+      reset_cpu();
+      memset(&state, 0, sizeof state);
+      // the handler reads the device 11 cycles after the interrupt is taken
+      assemble("       CLI\n"
+               "       LDA #$10\n"
+               "       STA $D003\n"  // IRQ in 4096 cycles
+               "wait:  INX\n"
+               "       LDA $20\n"
+               "       BEQ wait\n"
+               "       BRK\n", 0x0600, out, &len);
+      memcpy(memory + 0x0600, out, len);
+      assemble("       LDA $D000\n"
+               "       INC $20\n"
+               "       RTI\n", 0x0700, out, &len);
+      memcpy(memory + 0x0700, out, len);
+      memory[0xFFFE] = 0x00;
+      memory[0xFFFF] = 0x07;
+      default_cpu.PC = 0x0600;
+      set_device_lag(lags[i]);
+      ok_time &= (attach_device(&clock, 0xD000, 4) == 0);
+      run_devices(10000000);
+      detach_devices();
+      uint64_t taken = state.read_cycle - 11;
+      if (i == 0) first = taken;
+      ok_time &= (default_cpu.stop == STOP_BRK && memory[0x20] == 1 && taken == first &&
+                  taken >= state.irq_due && taken - state.irq_due < 8);
+    }
+    set_device_lag(DEVICE_LAG_CYCLES);
+    END_TEST(ok_time);
+  }
+
   // ----------------------------------------------------------
   printf("\n6502 TEST SUMMARY: %d / %d tests passed.\n",
          passed_tests, total_tests);